@@ -1,130 +1,1613 @@
 #include "lacunarity.h"
 
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <limits.h>
+
 #include "raster.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "level_integral.h"
+#include "planner.h"
+#include "sparse.h"
+#include "raster_cache.h"
 #include "gdal.h"
 
 
+/**
+ * Prepares the input data for the computation: converts it to binary if
+ * needed, and sets the invalid pixels to 0 so that they do not count for
+ * the number of levels. The mask may be NULL if all pixels are valid.
+ */
+static void prepare_input_data (long *data, unsigned char *mask, long nPixels,
+            int binary, long binaryThreshold)
+{
+  long i;
+  
+  if (binary){
+    for (i = 0; i < nPixels; i++){
+      data[i] = (data[i] >= binaryThreshold) ? 1 : 0;
+    }
+  }
+  if (mask != NULL){
+    for (i = 0; i < nPixels; i++){
+      if (!mask[i]) data[i] = 0;
+    }
+  }
+}
+
+
+
+/**
+ * Converts a validity mask into a long array holding 1 for every invalid
+ * pixel, which can be summed up in a pyramid.
+ */
+static long *invalid_pixel_counts (unsigned char *mask, long nPixels)
+{
+  long *invalid;
+  long i;
+  
+  invalid = (long*)malloc(nPixels * sizeof(long));
+  if (invalid == NULL){
+    fprintf(stderr, "ERROR. Not enough memory for the nodata mask.\n");
+    return NULL;
+  }
+  for (i = 0; i < nPixels; i++) invalid[i] = mask[i] ? 0 : 1;
+  return invalid;
+}
+
+
+
+/**
+ * Returns the number of invalid pixels in the rectangle x0 <= x < x1,
+ * y0 <= y < y1 from the integral image of the invalid pixels. The unsigned
+ * arithmetic gives the right count even if the integral image wraps around.
+ */
+#define INVALID_COUNT(invalidSum, rasterX, x0, y0, x1, y1) \
+  (invalidSum[(long)(y1)*((rasterX)+1) + (x1)] - invalidSum[(long)(y0)*((rasterX)+1) + (x1)] - \
+   invalidSum[(long)(y1)*((rasterX)+1) + (x0)] + invalidSum[(long)(y0)*((rasterX)+1) + (x0)])
+
+
+
+double lacunarity_from_moments (double M, double M2)
+{
+  if (M <= 0) return 0.0;
+  return M2 / (M * M);
+}
+
+
+
+unsigned int *invalid_integral_image (unsigned char *mask, int rasterX, int rasterY)
+{
+  unsigned int *invalidSum;
+  unsigned int rowSum;
+  int i, j;
+  
+  invalidSum = (unsigned int*)calloc((size_t)(rasterX+1) * (rasterY+1), sizeof(unsigned int));
+  if (invalidSum == NULL){
+    fprintf(stderr, "ERROR. Not enough memory for the nodata mask.\n");
+    return NULL;
+  }
+  for (j = 0; j < rasterY; j++){
+    rowSum = 0;
+    for (i = 0; i < rasterX; i++){
+      if (!mask[(long)j*rasterX + i]) rowSum++;
+      invalidSum[(long)(j+1)*(rasterX+1) + i+1] = invalidSum[(long)j*(rasterX+1) + i+1] + rowSum;
+    }
+  }
+  return invalidSum;
+}
+
+
+
+unsigned long long invalid_pixels_in_window (unsigned int *invalidSum, int rasterX,
+            int x0, int y0, int w, int h)
+{
+  unsigned long long n;
+  long y, bandH;
+  
+  // The 32-bit counts are exact for rectangles of fewer than 2^32 pixels,
+  // so larger windows are counted in bands of rows.
+  bandH = (long)(UINT_MAX / (unsigned long)MAX(w, 1));
+  n = 0;
+  for (y = y0; y < (long)y0 + h; y += bandH){
+    n += INVALID_COUNT(invalidSum, rasterX, x0, y, x0 + w, MIN(y + bandH, (long)y0 + h));
+  }
+  return n;
+}
+
+
+
+/**
+ * The approximated gliding box sizes for which the deviation from the
+ * exact lacunarity is reported.
+ */
+typedef struct lacunarity_calibration {
+  int n;
+  int gbox[APPROX_CALIBRATION_SIZES];
+  double exact[APPROX_CALIBRATION_SIZES];
+  double approx[APPROX_CALIBRATION_SIZES];
+} lacunarity_calibration;
+
+
+
+/**
+ * Computes the lacunarity curve of a prepared data array (see
+ * prepare_input_data) with rows pitch values apart. The mask may be NULL
+ * if all pixels are valid. The approximation needs contiguous rows
+ * (pitch == rasterX). If calibration is not NULL, the exact values of the
+ * smallest approximated box sizes are computed as well. The exact values
+ * are computed by the given engine; with the histogram engine, binary images
+ * use their sparse representation for the box sizes where it is expected to
+ * be faster.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+static int lacunarity_curve_data (long *data, unsigned char *mask, 
+            int pitch, int rasterX, int rasterY,
+            int binary, int f3d,
+            int gbox_min, int gbox_max, int gbox_step,
+            int approxMinBox, lacunarity_engine engine,
+            double *curve, lacunarity_calibration *calibration)
+{
+  unsigned int *invalidSum;     // Integral image of the invalid pixels.
+  long *invalid;                // Invalid pixels, for the pyramid.
+  int i, g, n;
+  double l;
+  long *levels[32];             // Pyramid levels used for approximation.
+  long *invalidLevels[32];
+  int levelX[32], levelY[32];
+  int level;
+  sparse_raster *sparse;        // Sparse representation of binary images.
+  double density;               // Fraction of foreground and invalid pixels.
+  int ok;
+  
+  // The approximation relies on box masses being sums of pixel values,
+  // which holds for binary images only.
+  if (approxMinBox > 0 && !binary){
+    fprintf(stderr, "Warning. The approximation is only available for binary images.\n");
+    fprintf(stderr, "The lacunarity is computed exactly.\n");
+    approxMinBox = 0;
+  }
+  
+  // Gliding boxes touching nodata pixels are left out, which we check in
+  // O(1) using an integral image of the invalid pixels.
+  invalidSum = NULL;
+  invalid = NULL;
+  if (mask != NULL){
+    invalidSum = invalid_integral_image(mask, rasterX, rasterY);
+    if (approxMinBox > 0){
+      invalid = invalid_pixel_counts(mask, (long)rasterX * rasterY);
+    }
+    if (invalidSum == NULL || (approxMinBox > 0 && invalid == NULL)){
+      free(invalidSum);
+      free(invalid);
+      return 1;
+    }
+  }
+  
+  // The sparse representation is built if it pays off for any box size.
+  sparse = NULL;
+  density = 1.0;
+  if (binary && engine != LACUNARITY_ENGINE_INTEGRAL){
+    density = sparse_density(data, pitch, mask, rasterX, rasterY);
+    for (g = gbox_min; g <= gbox_max; g += gbox_step){
+      if (sparse_is_faster(density, g, rasterX, rasterY)) break;
+    }
+    if (g <= gbox_max){
+      sparse = sparse_raster_new(data, pitch, mask, rasterX, rasterY);
+      if (sparse == NULL){
+        free(invalidSum);
+        free(invalid);
+        return 1;
+      }
+    }
+  }
+  
+  for (i = 0; i < 32; i++){
+    levels[i] = NULL;
+    invalidLevels[i] = NULL;
+  }
+  if (calibration != NULL) calibration->n = 0;
+  
+  ok = 0;
+  n = 0;
+  for (g = gbox_min; g <= gbox_max; g += gbox_step){
+    level = 0;
+    if (approxMinBox > 0 && g >= approxMinBox){
+      level = pyramid_level_for_box(g, MIN(rasterX, rasterY));
+    }
+    if (level == 0 && engine == LACUNARITY_ENGINE_INTEGRAL){
+      if (level_integral_lacunarity(data, pitch, invalidSum, rasterX, rasterY, f3d, g,
+            rasterX, rasterY, &l) != 0){
+        ok = 1;
+        break;
+      }
+    }else if (level == 0 && sparse != NULL && sparse_is_faster(density, g, rasterX, rasterY)){
+      l = sparse_lacunarity_in_window(sparse, g, 0, 0, rasterX, rasterY);
+    }else if (level == 0){
+      l = lacunarity_in_masked_window(data, invalidSum, pitch, rasterY, f3d, g, 
+            0, 0, rasterX, rasterY);
+    }else{
+      // Evaluate the box on the pyramid level, building it if needed.
+      if (levels[level] == NULL){
+        levels[level] = pyramid_level(data, rasterX, rasterY, level, &levelX[level], &levelY[level]);
+        if (invalid != NULL){
+          invalidLevels[level] = pyramid_level(invalid, rasterX, rasterY, level, 
+                                   &levelX[level], &levelY[level]);
+        }
+        if (levels[level] == NULL || (invalid != NULL && invalidLevels[level] == NULL)){
+          ok = 1;
+          break;
+        }
+      }
+      l = pyramid_lacunarity_in_window(levels[level], invalidLevels[level], 
+            levelX[level], levelY[level], 
+            (double)g / (1 << level), 0, 0, levelX[level], levelY[level]);
+      if (calibration != NULL && calibration->n < APPROX_CALIBRATION_SIZES){
+        calibration->gbox[calibration->n] = g;
+        calibration->approx[calibration->n] = l;
+        calibration->n++;
+      }
+    }
+    if (l == LACUNARITY_ERROR){
+      ok = 1;
+      break;
+    }
+    curve[n++] = l;
+  }
+  
+  // For binary images, the exact value is computed from the box masses at
+  // full resolution.
+  if (ok == 0 && calibration != NULL){
+    for (i = 0; i < calibration->n; i++){
+      calibration->exact[i] = pyramid_lacunarity_in_window(data, invalid, rasterX, rasterY, 
+            (double)calibration->gbox[i], 0, 0, rasterX, rasterY);
+      if (calibration->exact[i] == LACUNARITY_ERROR) ok = 1;
+    }
+  }
+  
+  for (i = 0; i < 32; i++){
+    free(levels[i]);
+    free(invalidLevels[i]);
+  }
+  sparse_raster_free(sparse);
+  free(invalidSum);
+  free(invalid);
+  return ok;
+}
+
+
+
+/**
+ * Chooses and prints the execution plan of a run on a band if there is a
+ * memory budget. The request is completed with the properties of the band;
+ * the size of the raster or output region must already be set.
+ * Returns 0 if a plan fits, a non-zero value otherwise.
+ */
+static int plan_for_band (GDALRasterBandH band, plan_request *request, lacunarity_exec *exec)
+{
+  double memory;
+  
+  if (exec->maxMemory == 0) return 0;
+  request->hasMask = raster_band_has_mask(band);
+  request->maxValue = request->binary ? 1 : raster_band_max_value(band);
+  if (plan_execution(request, exec, &memory) != 0) return 1;
+  plan_print(request, exec, memory);
+  return 0;
+}
+
+
+
 int lacunarity (char *input_raster, int band, 
         int binary, long binaryThreshold, int f3d,
-        int gbox_min, int gbox_max, int gbox_step)
+        int gbox_min, int gbox_max, int gbox_step,
+        int approxMinBox, lacunarity_exec *exec)
 {
   
-  long *data, *dataPtr;
+  long *data;
+  unsigned char *mask;          // Validity mask, NULL if all pixels are valid.
   int rasterX, rasterY, i;
   int ok, g;
-  double l;
+  double *curve;
+  lacunarity_calibration calibration;
+  lacunarity_exec plan;         // The execution options chosen for the budget.
+  plan_request request;
+  GDALDatasetH dataset;
+  raster_cache cache;           // The mapped cache of the prepared band.
+  int cached;                   // Whether the band is taken from the cache.
   
-  ok = raster_band_read_long(input_raster, band, &data, &rasterX, &rasterY);
-  if (ok != 0) return 1;
+  if (gbox_step < 1 || gbox_min < 1 || gbox_min > gbox_max){
+    fprintf(stderr, "ERROR. Invalid range of gliding box sizes.\n");
+    return 1;
+  }
   
-  // Convert to binary if needed.
-  if (binary){
-    dataPtr = data;
-    for (i = 0; i < (rasterX * rasterY); i++){
-      if (*dataPtr >= binaryThreshold) *dataPtr = 1;
-      else *dataPtr = 0;
-      dataPtr++;
+  // With a memory budget, check up front that the run fits.
+  plan = *exec;
+  if (plan.maxMemory > 0){
+    dataset = GDALOpen(input_raster, GA_ReadOnly);
+    if (dataset == NULL || GDALGetRasterBand(dataset, band) == NULL){
+      fprintf(stderr, "ERROR. Unable to read band %i of the input raster file.\n", band);
+      if (dataset != NULL) GDALClose(dataset);
+      return 1;
     }
+    request.spatial = 0;
+    request.rasterX = GDALGetRasterXSize(dataset);
+    request.rasterY = GDALGetRasterYSize(dataset);
+    request.binary = binary;
+    request.f3d = f3d;
+    request.gbox_min = gbox_min;
+    request.gbox_max = gbox_max;
+    request.gbox_step = gbox_step;
+    request.mwin = 0;
+    request.approxMinBox = approxMinBox;
+    request.adaptive = 0;
+    request.exactMask = 0;
+    ok = plan_for_band(GDALGetRasterBand(dataset, band), &request, &plan);
+    GDALClose(dataset);
+    if (ok != 0) return 1;
+  }
+  
+  curve = (double*)malloc((size_t)((gbox_max - gbox_min) / gbox_step + 1) * sizeof(double));
+  if (curve == NULL){
+    fprintf(stderr, "ERROR. Not enough memory for the lacunarity curve.\n");
+    return 1;
+  }
+  
+  // The prepared band is taken from the cache if it matches this run; it
+  // is only read, so the mapped pages stay shared.
+  cached = 0;
+  if (exec->cacheFile != NULL){
+    ok = raster_cache_open(exec->cacheFile, input_raster, band, binary, binaryThreshold, &cache);
+    if (ok < 0){
+      free(curve);
+      return 1;
+    }
+    cached = (ok == 0);
+  }
+  if (cached){
+    fprintf(stdout, "Using the cached band in %s.\n", exec->cacheFile);
+    data = cache.data;
+    mask = cache.mask;
+    rasterX = cache.rasterX;
+    rasterY = cache.rasterY;
+  }else{
+    ok = raster_band_read_long(input_raster, band, &data, &rasterX, &rasterY);
+    if (ok != 0){
+      free(curve);
+      return 1;
+    }
+    ok = raster_band_read_mask(input_raster, band, &mask);
+    if (ok != 0){
+      free(curve);
+      free(data);
+      return 1;
+    }
+    
+    // Convert to binary if needed, and clear the nodata pixels.
+    prepare_input_data(data, mask, (long)rasterX * rasterY, binary, binaryThreshold);
+    if (exec->cacheFile != NULL &&
+        raster_cache_write(exec->cacheFile, input_raster, band, binary, binaryThreshold,
+          data, mask, rasterX, rasterY) == 0){
+      fprintf(stdout, "Cached the band in %s.\n", exec->cacheFile);
+    }
+  }
+  
+  ok = lacunarity_curve_data(data, mask, rasterX, rasterX, rasterY, binary, f3d, 
+         gbox_min, gbox_max, gbox_step, approxMinBox, plan.engine, curve, &calibration);
+  if (cached){
+    raster_cache_close(&cache);
+  }else{
+    free(mask);
+    free(data);
+  }
+  if (ok != 0){
+    free(curve);
+    return 1;
   }
   
   fprintf(stdout, "Lacunarity index for %s:\n", input_raster);
   fprintf(stdout, "Gliding box size\tLacunarity index\n");
+  for (g = gbox_min, i = 0; g <= gbox_max; g += gbox_step, i++){
+    fprintf(stdout, "%i\t%f\n", g, curve[i]);
+  }
   
+  // Report the deviation from the exact values for the smallest
+  // approximated gliding box sizes.
+  if (calibration.n > 0){
+    fprintf(stdout, "Approximation check:\n");
+    fprintf(stdout, "Gliding box size\tExact\tApproximate\tRelative deviation\n");
+    for (i = 0; i < calibration.n; i++){
+      fprintf(stdout, "%i\t%f\t%f\t%.3f%%\n", calibration.gbox[i], 
+          calibration.exact[i], calibration.approx[i],
+          (calibration.exact[i] > 0) ? 
+            100.0 * (calibration.approx[i] - calibration.exact[i]) / calibration.exact[i] : 0.0);
+    }
+  }
+  
+  free(curve);
+  return 0;
+}
+
+
+/**
+ * Computes the binary lacunarity curves of a data array for several
+ * thresholds. One pass over the data builds an integral image of the
+ * thresholded pixels for every threshold (interleaved, so that the box
+ * sums of all thresholds are read together); each gliding box is then
+ * checked once for invalid pixels and summed in O(1) per threshold.
+ * The integral images use 32-bit unsigned counters, whose differences are
+ * exact even if they wrap around, as a box holds far fewer than 2^32
+ * pixels. curves receives nThresholds values per gliding box size.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+static int threshold_curves_data (long *data, unsigned char *mask, int rasterX, int rasterY,
+            long *thresholds, int nThresholds,
+            int gbox_min, int gbox_max, int gbox_step,
+            double *curves)
+{
+  unsigned int *integral;       // Integral images of the thresholded pixels.
+  unsigned int *invalidSum;     // Integral image of the invalid pixels.
+  unsigned int *rowSum;
+  double *sum, *sum2;           // Moments of the box masses per threshold.
+  long pitch;                   // Distance between two rows of the integral images.
+  long nBoxes;
+  long p00, p01, p10, p11;
+  unsigned int mass;
+  int allInvalid;               // Whether no pixel is valid.
+  int i, j, k, g, n;
+  long v;
+  
+  pitch = (long)(rasterX + 1) * nThresholds;
+  integral = (unsigned int*)calloc((size_t)pitch * (rasterY + 1), sizeof(unsigned int));
+  rowSum = (unsigned int*)malloc(nThresholds * sizeof(unsigned int));
+  sum = (double*)malloc(nThresholds * sizeof(double));
+  sum2 = (double*)malloc(nThresholds * sizeof(double));
+  invalidSum = NULL;
+  if (mask != NULL) invalidSum = invalid_integral_image(mask, rasterX, rasterY);
+  if (integral == NULL || rowSum == NULL || sum == NULL || sum2 == NULL || 
+      (mask != NULL && invalidSum == NULL)){
+    fprintf(stderr, "ERROR. Not enough memory for the threshold integral images.\n");
+    free(integral);
+    free(rowSum);
+    free(sum);
+    free(sum2);
+    free(invalidSum);
+    return 1;
+  }
+  
+  // Build all integral images in a single pass over the data.
+  for (j = 0; j < rasterY; j++){
+    memset(rowSum, 0, nThresholds * sizeof(unsigned int));
+    for (i = 0; i < rasterX; i++){
+      v = data[(long)j*rasterX + i];
+      if (mask == NULL || mask[(long)j*rasterX + i]){
+        for (k = 0; k < nThresholds; k++){
+          if (v >= thresholds[k]) rowSum[k]++;
+        }
+      }
+      for (k = 0; k < nThresholds; k++){
+        integral[(j+1)*pitch + (i+1)*nThresholds + k] = 
+          integral[j*pitch + (i+1)*nThresholds + k] + rowSum[k];
+      }
+    }
+  }
+  
+  allInvalid = (invalidSum != NULL && 
+    invalid_pixels_in_window(invalidSum, rasterX, 0, 0, rasterX, rasterY) == 
+      (unsigned long long)rasterX * rasterY);
+  
+  n = 0;
   for (g = gbox_min; g <= gbox_max; g += gbox_step){
-    l = lacunarity_in_window(data, rasterX, rasterY, f3d, g, 0, 0, rasterX, rasterY);
-    fprintf(stdout, "%i\t%f\n", g, l);
+    for (k = 0; k < nThresholds; k++){
+      sum[k] = 0;
+      sum2[k] = 0;
+    }
+    nBoxes = 0;
+    for (j = 0; j + g <= rasterY; j++){
+      for (i = 0; i + g <= rasterX; i++){
+        if (invalidSum != NULL && INVALID_COUNT(invalidSum, rasterX, i, j, i+g, j+g) > 0) continue;
+        p00 = j*pitch + i*nThresholds;
+        p01 = j*pitch + (i+g)*nThresholds;
+        p10 = (j+g)*pitch + i*nThresholds;
+        p11 = (j+g)*pitch + (i+g)*nThresholds;
+        for (k = 0; k < nThresholds; k++){
+          mass = integral[p11+k] - integral[p01+k] - integral[p10+k] + integral[p00+k];
+          sum[k] += mass;
+          sum2[k] += (double)mass * mass;
+        }
+        nBoxes++;
+      }
+    }
+    
+    // The same rules as in lacunarity_in_masked_window(): a raster without
+    // any valid pixel is nodata, and an empty thresholded image is 0 even if
+    // no gliding box is valid.
+    for (k = 0; k < nThresholds; k++){
+      if (allInvalid){
+        curves[n*nThresholds + k] = LACUNARITY_NODATA;
+      }else if (integral[rasterY*pitch + rasterX*nThresholds + k] == 0){
+        curves[n*nThresholds + k] = 0.0;
+      }else if (nBoxes == 0){
+        curves[n*nThresholds + k] = LACUNARITY_NODATA;
+      }else{
+        curves[n*nThresholds + k] = lacunarity_from_moments(sum[k] / nBoxes, sum2[k] / nBoxes);
+      }
+    }
+    n++;
   }
   
+  free(integral);
+  free(rowSum);
+  free(sum);
+  free(sum2);
+  free(invalidSum);
+  return 0;
+}
+
+
+
+int lacunarity_thresholds (char *input_raster, int band, 
+        long *thresholds, int nThresholds,
+        int gbox_min, int gbox_max, int gbox_step)
+{
+  long *data;
+  unsigned char *mask;          // Validity mask, NULL if all pixels are valid.
+  int rasterX, rasterY;
+  int ok, g, i, k;
+  double *curves;
+  
+  if (gbox_step < 1 || gbox_min < 1 || gbox_min > gbox_max || nThresholds < 1){
+    fprintf(stderr, "ERROR. Invalid range of gliding box sizes.\n");
+    return 1;
+  }
+  ok = raster_band_read_long(input_raster, band, &data, &rasterX, &rasterY);
+  if (ok != 0) return 1;
+  ok = raster_band_read_mask(input_raster, band, &mask);
+  if (ok != 0){
+    free(data);
+    return 1;
+  }
+  curves = (double*)malloc((size_t)((gbox_max - gbox_min) / gbox_step + 1) * nThresholds * sizeof(double));
+  if (curves == NULL){
+    fprintf(stderr, "ERROR. Not enough memory for the lacunarity curves.\n");
+    free(mask);
+    free(data);
+    return 1;
+  }
+  ok = threshold_curves_data(data, mask, rasterX, rasterY, thresholds, nThresholds, 
+         gbox_min, gbox_max, gbox_step, curves);
+  free(mask);
   free(data);
+  if (ok != 0){
+    free(curves);
+    return 1;
+  }
+  
+  fprintf(stdout, "Binary lacunarity index for %s:\n", input_raster);
+  fprintf(stdout, "Gliding box size");
+  for (k = 0; k < nThresholds; k++) fprintf(stdout, "\tThreshold %li", thresholds[k]);
+  fprintf(stdout, "\n");
+  for (g = gbox_min, i = 0; g <= gbox_max; g += gbox_step, i++){
+    fprintf(stdout, "%i", g);
+    for (k = 0; k < nThresholds; k++) fprintf(stdout, "\t%f", curves[i*nThresholds + k]);
+    fprintf(stdout, "\n");
+  }
+  
+  free(curves);
+  return 0;
+}
+
+
+
+void shard_tile_grid (int nShards, int outRasterX, int outRasterY, 
+            int *nTilesX, int *nTilesY)
+{
+  int tx, ty;
+  double perimeter, bestPerimeter;
+  
+  // Among all factorisations nShards = tx * ty, take the one with the most
+  // square tiles. This keeps the halo overhead (the mwin-1 pixels each
+  // tile reads in addition) as small as possible.
+  *nTilesX = nShards;
+  *nTilesY = 1;
+  bestPerimeter = -1;
+  for (ty = 1; ty <= nShards; ty++){
+    if (nShards % ty != 0) continue;
+    tx = nShards / ty;
+    perimeter = (double)outRasterX / tx + (double)outRasterY / ty;
+    if (bestPerimeter < 0 || perimeter < bestPerimeter){
+      bestPerimeter = perimeter;
+      *nTilesX = tx;
+      *nTilesY = ty;
+    }
+  }
+}
+
+
+
+void lacunarity_exec_defaults (lacunarity_exec *exec)
+{
+  long nCpus;
+  
+  exec->shard = 0;
+  exec->nShards = 1;
+  nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+  exec->nThreads = (nCpus > 0) ? (int)nCpus : 1;
+  exec->tileSize = 256;
+  exec->queueDepth = 2;
+  exec->engine = LACUNARITY_ENGINE_HISTOGRAM;
+  exec->maxMemory = 0;
+  exec->cacheFile = NULL;
+}
+
+
+
+/**
+ * The parameters needed for computing the lacunarity values of a tile.
+ */
+typedef struct spatial_tile_params {
+  int binary;
+  long binaryThreshold;
+  int f3d;
+  int gbox;
+  int mwin;
+  int approxMinBox;
+  lacunarity_engine engine;
+  const lacunarity_raster *direct;  // Caller buffer used without copying, or
+                                    // NULL if the tiles hold their data.
+  double adaptiveTolerance;     // Refinement tolerance, or negative for
+                                // computing every window.
+  int adaptiveStep;             // The spacing of the coarse grid.
+} spatial_tile_params;
+
+
+
+/**
+ * The state of the adaptive refinement of a tile.
+ */
+typedef struct adaptive_grid {
+  pipeline_tile *tile;
+  spatial_tile_params *p;
+  unsigned int *invalidSum;
+  sparse_raster *sparse;        // The sparse tile data, or NULL.
+  unsigned char *exact;         // Flags of the windows computed so far.
+} adaptive_grid;
+
+
+
+/**
+ * Returns the lacunarity of the window at i/j of a tile, computing it
+ * if it has not been computed yet.
+ */
+static double adaptive_value (adaptive_grid *g, int i, int j)
+{
+  long n;
+  
+  n = (long)j * g->tile->w + i;
+  if (!g->exact[n] && g->sparse != NULL){
+    g->tile->lacunarity[n] = sparse_lacunarity_in_window(
+      g->sparse, g->p->gbox, i, j, g->p->mwin, g->p->mwin
+    );
+    g->exact[n] = 1;
+  }else if (!g->exact[n]){
+    g->tile->lacunarity[n] = lacunarity_in_masked_window(
+      g->tile->data, g->invalidSum, g->tile->dataX, g->tile->dataY, 
+      g->p->f3d, g->p->gbox, i, j, g->p->mwin, g->p->mwin
+    );
+    g->exact[n] = 1;
+  }
+  return g->tile->lacunarity[n];
+}
+
+
+
+/**
+ * Fills the cell of a tile between the windows x0/y0 and x1/y1 (included).
+ * The corner windows are computed. If they are all valid and differ by
+ * at most the tolerance, the other windows are interpolated bilinearly
+ * from them; otherwise the cell is split in halves and refined.
+ */
+static void adaptive_cell (adaptive_grid *g, int x0, int y0, int x1, int y1)
+{
+  double v00, v10, v01, v11, vmin, vmax, tx, ty;
+  int i, j, xm, ym;
+  
+  v00 = adaptive_value(g, x0, y0);
+  v10 = adaptive_value(g, x1, y0);
+  v01 = adaptive_value(g, x0, y1);
+  v11 = adaptive_value(g, x1, y1);
+  if (x1 - x0 <= 1 && y1 - y0 <= 1) return;
+  
+  vmin = MIN(MIN(v00, v10), MIN(v01, v11));
+  vmax = MAX(MAX(v00, v10), MAX(v01, v11));
+  if (vmin == LACUNARITY_NODATA || vmax - vmin > g->p->adaptiveTolerance){
+    xm = (x0 + x1) / 2;
+    ym = (y0 + y1) / 2;
+    if (x1 - x0 > 1 && y1 - y0 > 1){
+      adaptive_cell(g, x0, y0, xm, ym);
+      adaptive_cell(g, xm, y0, x1, ym);
+      adaptive_cell(g, x0, ym, xm, y1);
+      adaptive_cell(g, xm, ym, x1, y1);
+    }else if (x1 - x0 > 1){
+      adaptive_cell(g, x0, y0, xm, y1);
+      adaptive_cell(g, xm, y0, x1, y1);
+    }else{
+      adaptive_cell(g, x0, y0, x1, ym);
+      adaptive_cell(g, x0, ym, x1, y1);
+    }
+    return;
+  }
+  
+  for (j = y0; j <= y1; j++){
+    ty = (y1 > y0) ? (double)(j - y0) / (y1 - y0) : 0.0;
+    for (i = x0; i <= x1; i++){
+      if (g->exact[(long)j * g->tile->w + i]) continue;
+      tx = (x1 > x0) ? (double)(i - x0) / (x1 - x0) : 0.0;
+      g->tile->lacunarity[(long)j * g->tile->w + i] = 
+        (1 - ty) * ((1 - tx) * v00 + tx * v10) + ty * ((1 - tx) * v01 + tx * v11);
+    }
+  }
+}
+
+
+
+/**
+ * Computes the lacunarity of a tile adaptively: the windows on a coarse
+ * grid are computed first, and each grid cell is refined where needed
+ * (see adaptive_cell). The exactly computed windows are flagged in
+ * tile->exact if it is not NULL.
+ */
+static int adaptive_tile (pipeline_tile *tile, spatial_tile_params *p, unsigned int *invalidSum,
+            sparse_raster *sparse)
+{
+  adaptive_grid g;
+  int x0, y0, step;
+  
+  g.tile = tile;
+  g.p = p;
+  g.invalidSum = invalidSum;
+  g.sparse = sparse;
+  g.exact = tile->exact;
+  if (g.exact == NULL){
+    g.exact = (unsigned char*)calloc((size_t)tile->w * tile->h, 1);
+    if (g.exact == NULL){
+      fprintf(stderr, "ERROR. Not enough memory for the adaptive refinement.\n");
+      return 1;
+    }
+  }else{
+    memset(g.exact, 0, (size_t)tile->w * tile->h);
+  }
+  
+  step = MAX(p->adaptiveStep, 1);
+  for (y0 = 0; y0 < tile->h; y0 += step){
+    for (x0 = 0; x0 < tile->w; x0 += step){
+      adaptive_cell(&g, x0, y0, MIN(x0 + step, tile->w - 1), MIN(y0 + step, tile->h - 1));
+    }
+  }
+  
+  if (g.exact != tile->exact) free(g.exact);
+  return 0;
+}
+
+
+
+/**
+ * Computes the lacunarity values of one pipeline tile.
+ */
+static int spatial_lacunarity_tile_values (pipeline_tile *tile, void *arg)
+{
+  spatial_tile_params *p = (spatial_tile_params*)arg;
+  double *lacunarityPtr;
+  int i, j;
+  long nPixels;
+  unsigned int *invalidSum;     // Integral image of the invalid pixels.
+  long *invalid;                // Invalid pixels, for the pyramid.
+  int level;                    // Pyramid level used for approximation.
+  long *coarse;                 // The tile data on this level.
+  long *coarseInvalid;          // The invalid pixel counts on this level.
+  int coarseX, coarseY;
+  double *cellValues;           // The lacunarity for each cell of this level.
+  int cellW, cellH;
+  sparse_raster *sparse;        // Sparse tile data of binary images.
+  int ok;
+  
+  // Unless refined adaptively or approximated, every window is computed.
+  if (tile->exact != NULL) memset(tile->exact, 1, (size_t)tile->w * tile->h);
+  
+  // Without copying, the windows are taken from the caller buffer; the
+  // output region starts at its origin.
+  if (p->direct != NULL && p->engine == LACUNARITY_ENGINE_INTEGRAL){
+    return level_integral_lacunarity(
+      (long*)((const char*)p->direct->pixels + (size_t)tile->y * p->direct->stride) + tile->x,
+      (int)(p->direct->stride / sizeof(long)), NULL, tile->dataX, tile->dataY,
+      p->f3d, p->gbox, p->mwin, p->mwin, tile->lacunarity
+    );
+  }
+  if (p->direct != NULL){
+    lacunarityPtr = tile->lacunarity;
+    for (j = 0; j < tile->h; j++){
+      for (i = 0; i < tile->w; i++){
+        *lacunarityPtr = lacunarity_in_window(
+          (long*)p->direct->pixels, (int)(p->direct->stride / sizeof(long)), p->direct->height,
+          p->f3d, p->gbox, tile->x + i, tile->y + j, p->mwin, p->mwin
+        );
+        lacunarityPtr++;
+      }
+    }
+    return 0;
+  }
+  
+  // A fully masked tile has not been read; there is nothing to compute.
+  if (tile->data == NULL){
+    for (i = 0; i < (tile->w * tile->h); i++) tile->lacunarity[i] = LACUNARITY_NODATA;
+    return 0;
+  }
+  
+  // Convert to binary if needed, and clear the nodata pixels.
+  nPixels = (long)tile->dataX * tile->dataY;
+  prepare_input_data(tile->data, tile->mask, nPixels, p->binary, p->binaryThreshold);
+  invalidSum = NULL;
+  if (tile->mask != NULL){
+    invalidSum = invalid_integral_image(tile->mask, tile->dataX, tile->dataY);
+    if (invalidSum == NULL) return 1;
+  }
+  
+  // For large gliding boxes on binary images, the lacunarity may be
+  // approximated on a pyramid level. All output pixels falling into the
+  // same cell of this level share the moving window on the level.
+  level = 0;
+  if (p->binary && p->approxMinBox > 0 && p->gbox >= p->approxMinBox){
+    level = pyramid_level_for_box(p->gbox, p->mwin);
+  }
+  if (level > 0){
+    free(invalidSum);
+    coarse = pyramid_level(tile->data, tile->dataX, tile->dataY, level, &coarseX, &coarseY);
+    coarseInvalid = NULL;
+    if (tile->mask != NULL){
+      invalid = invalid_pixel_counts(tile->mask, nPixels);
+      if (invalid != NULL){
+        coarseInvalid = pyramid_level(invalid, tile->dataX, tile->dataY, level, &coarseX, &coarseY);
+        free(invalid);
+      }
+    }
+    cellW = ((tile->w - 1) >> level) + 1;
+    cellH = ((tile->h - 1) >> level) + 1;
+    cellValues = (double*)malloc((size_t)cellW * cellH * sizeof(double));
+    if (coarse == NULL || cellValues == NULL || (tile->mask != NULL && coarseInvalid == NULL)){
+      fprintf(stderr, "ERROR. Not enough memory for the approximation.\n");
+      free(coarse);
+      free(coarseInvalid);
+      free(cellValues);
+      return 1;
+    }
+    for (j = 0; j < cellH; j++){
+      for (i = 0; i < cellW; i++){
+        cellValues[j*cellW + i] = pyramid_lacunarity_in_window(
+          coarse, coarseInvalid, coarseX, coarseY, (double)p->gbox / (1 << level), 
+          i, j, p->mwin >> level, p->mwin >> level
+        );
+      }
+    }
+    lacunarityPtr = tile->lacunarity;
+    for (j = 0; j < tile->h; j++){
+      for (i = 0; i < tile->w; i++){
+        *lacunarityPtr = cellValues[(j >> level)*cellW + (i >> level)];
+        lacunarityPtr++;
+      }
+    }
+    if (tile->exact != NULL) memset(tile->exact, 0, (size_t)tile->w * tile->h);
+    free(cellValues);
+    free(coarse);
+    free(coarseInvalid);
+    return 0;
+  }
+  
+  if (p->engine == LACUNARITY_ENGINE_INTEGRAL){
+    ok = level_integral_lacunarity(tile->data, tile->dataX, invalidSum, tile->dataX, tile->dataY,
+           p->f3d, p->gbox, p->mwin, p->mwin, tile->lacunarity);
+    free(invalidSum);
+    return ok;
+  }
+  
+  // Binary tiles use their sparse representation if it is expected to be
+  // faster.
+  sparse = NULL;
+  if (p->binary &&
+      sparse_is_faster(sparse_density(tile->data, tile->dataX, tile->mask, tile->dataX, tile->dataY),
+        p->gbox, p->mwin, p->mwin)){
+    sparse = sparse_raster_new(tile->data, tile->dataX, tile->mask, tile->dataX, tile->dataY);
+    if (sparse == NULL){
+      free(invalidSum);
+      return 1;
+    }
+  }
+  
+  if (p->adaptiveTolerance >= 0){
+    ok = adaptive_tile(tile, p, invalidSum, sparse);
+    sparse_raster_free(sparse);
+    free(invalidSum);
+    return ok;
+  }
+  
+  lacunarityPtr = tile->lacunarity;
+  for (j = 0; j < tile->h; j++){
+    for (i = 0; i < tile->w; i++){
+      if (sparse != NULL){
+        *lacunarityPtr = sparse_lacunarity_in_window(sparse, p->gbox, i, j, p->mwin, p->mwin);
+      }else{
+        *lacunarityPtr = lacunarity_in_masked_window(
+          tile->data, invalidSum, tile->dataX, tile->dataY, p->f3d, p->gbox, i, j, p->mwin, p->mwin
+        );
+      }
+      lacunarityPtr++;
+    }
+  }
+  sparse_raster_free(sparse);
+  free(invalidSum);
+  return 0;
+}
+
+
+
+/**
+ * Computes the lacunarity values of one pipeline tile (see
+ * spatial_lacunarity_tile_values). The window functions report their
+ * errors as LACUNARITY_ERROR values, which fail the tile.
+ */
+static int spatial_lacunarity_tile (pipeline_tile *tile, void *arg)
+{
+  long n;
+  
+  if (spatial_lacunarity_tile_values(tile, arg) != 0) return 1;
+  for (n = 0; n < (long)tile->w * tile->h; n++){
+    if (tile->lacunarity[n] == LACUNARITY_ERROR) return 1;
+  }
+  return 0;
+}
+
+
+
+/**
+ * The GDAL bands accessed by the pipeline callbacks.
+ */
+typedef struct gdal_io {
+  GDALRasterBandH input;
+  GDALRasterBandH output;
+  GDALRasterBandH exactOutput;  // The mask of the exactly computed windows.
+  int overviews;                // Whether the output overviews are written
+                                // along with the tiles.
+} gdal_io;
+
+static int gdal_io_read (void *arg, int xOff, int yOff, int xSize, int ySize, long *data)
+{
+  return raster_band_read_long_block(((gdal_io*)arg)->input, xOff, yOff, xSize, ySize, data);
+}
+
+static int gdal_io_read_mask (void *arg, int xOff, int yOff, int xSize, int ySize, 
+            unsigned char *mask)
+{
+  return raster_band_read_mask_block(((gdal_io*)arg)->input, xOff, yOff, xSize, ySize, mask);
+}
+
+static int gdal_io_write (void *arg, int xOff, int yOff, int xSize, int ySize, 
+            double *values)
+{
+  gdal_io *io = (gdal_io*)arg;
+  
+  if (raster_band_write_double_block(io->output, xOff, yOff, xSize, ySize, values) != 0){
+    return 1;
+  }
+  if (io->overviews){
+    return raster_band_write_overview_blocks(io->output, xOff, yOff, xSize, ySize, 
+             values, LACUNARITY_NODATA);
+  }
   return 0;
 }
 
+static int gdal_io_write_exact (void *arg, int xOff, int yOff, int xSize, int ySize, 
+            unsigned char *flags)
+{
+  return raster_band_write_byte_block(((gdal_io*)arg)->exactOutput, xOff, yOff, xSize, ySize, flags);
+}
+
+
 
 int spatial_lacunarity (char *input_raster, int band, 
             int binary, long binaryThreshold, int f3d,
-            int gbox, int mwin, 
-            char *output_file, char *format)
+            int gbox, int mwin, int approxMinBox,
+            double adaptiveTolerance, int adaptiveStep,
+            lacunarity_exec *exec,
+            char *output_file, char *exact_file, char *format)
 {
-  long *data, *dataPtr;         // The input data array.
   int rasterX, rasterY;         // The size of the input raster.
-  int i, j;                     // x- and y-coordinates loop variables
-  double *lacunarity;           // The lacunarity data array.
-  double *lacunarityPtr;
-  int outRasterX, outRasterY;   // The size of the output raster.
+  int outRasterX, outRasterY;   // The size of the full output raster.
+  int nTilesX, nTilesY;         // The tile grid used for sharding.
+  int tileX, tileY;             // Offset of the output tile of this shard.
+  int tileW, tileH;             // Size of the output tile of this shard.
   double georeference[6];       // Georeference for output raster file.
   GDALDatasetH dataset;         // The GDAL dataset for the input raster file.
+  GDALDatasetH outDataset;      // The GDAL dataset for the output raster file.
+  GDALDatasetH exactDataset;    // The GDAL dataset for the exact window mask.
+  GDALRasterBandH inBand;
+  spatial_tile_params tileParams;
+  pipeline_params pipeline;
+  gdal_io io;
+  lacunarity_exec plan;         // The execution options chosen for the budget.
+  plan_request request;
+  int cog;                      // Whether a Cloud-Optimized GeoTIFF is written.
+  int tileSize;                 // The size of the pipeline tiles.
+  int blockSize;                // The internal tile size of the GeoTIFF.
+  int nOverviews;
   int ok;
-  int pctDone, curPctDone;      // Percentage done.
   
-  // Read the input raster file.
-  ok = raster_band_read_long(input_raster, band, &data, &rasterX, &rasterY);
-  if (ok != 0){
-    fprintf(stderr, "ERROR. Unable to read input raster file.\n");
+  if (gbox < 1 || mwin < 1){
+    fprintf(stderr, "ERROR. Invalid gliding box or moving window size.\n");
     return 1;
   }
   
-  // Convert to binary if needed.
-  if (binary){
-    dataPtr = data;
-    for (i = 0; i < (rasterX * rasterY); i++){
-      if (*dataPtr >= binaryThreshold) *dataPtr = 1;
-      else *dataPtr = 0;
-      dataPtr++;
-    }
-  }
-  
-  // Get the georeference of the input raster.
+  // Get the size and georeference of the input raster.
   dataset = GDALOpen(input_raster, GA_ReadOnly);
+  if (dataset == NULL){
+    fprintf(stderr, "ERROR. Unable to read input raster file.\n");
+    return 1;
+  }
+  inBand = GDALGetRasterBand(dataset, band);
+  if (inBand == NULL){
+    fprintf(stderr, "ERROR. Unable to read band %i of the input raster file.\n", band);
+    GDALClose(dataset);
+    return 1;
+  }
+  rasterX = GDALGetRasterXSize(dataset);
+  rasterY = GDALGetRasterYSize(dataset);
   GDALGetGeoTransform(dataset, georeference);
   
-  // Create the output lacunarity data array.
+  // The size of the full output raster.
   outRasterX = rasterX - mwin + 1;
   outRasterY = rasterY - mwin + 1;
-  lacunarity = (double*)calloc(outRasterX * outRasterY, sizeof(double));
-  if (lacunarity == NULL){
-    fprintf(stderr,"ERROR. Not enough memory for creating lacunarity raster.\n");
-    free(data);
+  if (outRasterX <= 0 || outRasterY <= 0){
+    fprintf(stderr, "ERROR. The moving window is larger than the input raster.\n");
+    GDALClose(dataset);
     return 1;
   }
   
-  // Compute the lacunarity value for each point in the lacunarity array.
-  pctDone = 0;
-  lacunarityPtr = lacunarity;
-  for (j = 0; j < outRasterY; j++){
-    for (i = 0; i < outRasterX; i++){
-      *lacunarityPtr = lacunarity_in_window(
-        data, rasterX, rasterY, f3d, gbox, i, j, mwin, mwin
-      );
-      lacunarityPtr++;
-      
-      curPctDone = floorl(10*(j*outRasterX + i) / (outRasterX*outRasterY));
-      if (curPctDone > pctDone){
-        pctDone = curPctDone;
-        fprintf(stdout, "%i%% done.\n", pctDone*10);
-      }
-    }
+  // Find the output tile this shard is responsible for.
+  if (exec->nShards < 1 || exec->shard < 0 || exec->shard >= exec->nShards){
+    fprintf(stderr, "ERROR. Invalid shard %i of %i.\n", exec->shard, exec->nShards);
+    GDALClose(dataset);
+    return 1;
+  }
+  shard_tile_grid(exec->nShards, outRasterX, outRasterY, &nTilesX, &nTilesY);
+  if (nTilesX > outRasterX || nTilesY > outRasterY){
+    fprintf(stderr, "ERROR. Too many shards (%i) for an output raster of %ix%i pixels.\n", 
+        exec->nShards, outRasterX, outRasterY);
+    GDALClose(dataset);
+    return 1;
+  }
+  tileX = (int)(((long)outRasterX * (exec->shard % nTilesX)) / nTilesX);
+  tileY = (int)(((long)outRasterY * (exec->shard / nTilesX)) / nTilesY);
+  tileW = (int)(((long)outRasterX * (exec->shard % nTilesX + 1)) / nTilesX) - tileX;
+  tileH = (int)(((long)outRasterY * (exec->shard / nTilesX + 1)) / nTilesY) - tileY;
+  if (exec->nShards > 1){
+    fprintf(stdout, "Shard %i of %i: output tile at %i/%i, size %ix%i.\n", 
+        exec->shard, exec->nShards, tileX, tileY, tileW, tileH);
+  }
+  
+  // With a memory budget, choose the pipeline options up front.
+  plan = *exec;
+  request.spatial = 1;
+  request.rasterX = tileW;
+  request.rasterY = tileH;
+  request.binary = binary;
+  request.f3d = f3d;
+  request.gbox_min = gbox;
+  request.gbox_max = gbox;
+  request.gbox_step = 1;
+  request.mwin = mwin;
+  request.approxMinBox = approxMinBox;
+  request.adaptive = (adaptiveTolerance >= 0);
+  request.exactMask = (exact_file != NULL);
+  if (plan_for_band(inBand, &request, &plan) != 0){
+    GDALClose(dataset);
+    return 1;
   }
-  fprintf(stdout, "100%% done.\n");
-  fprintf(stdout, "Writing lacunarity image to file...\n");
   
-  // Write the output lacunarity raster to the output file.
+  // Create the output raster.
   // We need to provide the georeference.
-  // The output raster image is smaller by mwin-1 pixels.
-  georeference[0] += (mwin-1)*georeference[1];    // Shift the top left x coordinate.
-  georeference[3] += (mwin-1)*georeference[5];    // Shift the top left y coordinate.
-  ok = raster_band_write_double(output_file, format, 1, georeference, lacunarity, outRasterX, outRasterY);
-  if (ok != 0){
+  // The output raster image is smaller by mwin-1 pixels, and the tile
+  // of this shard is further shifted by its offset in the output raster.
+  georeference[0] += (mwin-1 + tileX)*georeference[1];    // Shift the top left x coordinate.
+  georeference[3] += (mwin-1 + tileY)*georeference[5];    // Shift the top left y coordinate.
+  // A COG output is written in internal tiles aligned with the pipeline
+  // tiles. The overviews are computed from the pipeline tiles as they are
+  // written, so only the levels where a pipeline tile covers whole
+  // overview tiles are created; the partial overview tiles of the other
+  // levels would be read back by GDAL. The tile size is rounded so that
+  // at least the first level exists.
+  tileSize = MAX(plan.tileSize, 1);
+  cog = (strcmp(format, "COG") == 0);
+  if (cog){
+    tileSize = MAX(tileSize / (2*RASTER_COG_OVERVIEW_BLOCK_SIZE) * (2*RASTER_COG_OVERVIEW_BLOCK_SIZE),
+                   2*RASTER_COG_OVERVIEW_BLOCK_SIZE);
+    blockSize = 16;
+    while (blockSize < 512 && tileSize % (blockSize * 2) == 0) blockSize *= 2;
+    nOverviews = 0;
+    while (tileSize % ((2 << nOverviews) * RASTER_COG_OVERVIEW_BLOCK_SIZE) == 0 && 
+           MAX(tileW, tileH) > (blockSize << nOverviews)){
+      nOverviews++;
+    }
+    outDataset = raster_open_output_cog(output_file, georeference, tileW, tileH, 
+                   blockSize, nOverviews);
+  }else{
+    outDataset = raster_open_output_double(output_file, format, georeference, tileW, tileH);
+  }
+  if (outDataset == NULL){
     fprintf(stderr, "ERROR. Unable to write output raster file.\n");
+    GDALClose(dataset);
+    return 1;
+  }
+  GDALSetRasterNoDataValue(GDALGetRasterBand(outDataset, 1), LACUNARITY_NODATA);
+  exactDataset = NULL;
+  if (exact_file != NULL){
+    exactDataset = raster_open_output_byte(exact_file, cog ? "GTiff" : format, 
+                     georeference, tileW, tileH);
+    if (exactDataset == NULL){
+      fprintf(stderr, "ERROR. Unable to write the exact window mask file.\n");
+      GDALClose(outDataset);
+      GDALClose(dataset);
+      return 1;
+    }
+  }
+  
+  // Compute the lacunarity of the shard tile. The tile is processed in
+  // smaller pipeline tiles that are read, computed and written concurrently;
+  // each of them is read with a halo of mwin-1 pixels.
+  tileParams.binary = binary;
+  tileParams.binaryThreshold = binaryThreshold;
+  tileParams.f3d = f3d;
+  tileParams.gbox = gbox;
+  tileParams.mwin = mwin;
+  tileParams.approxMinBox = approxMinBox;
+  tileParams.engine = plan.engine;
+  tileParams.direct = NULL;
+  tileParams.adaptiveTolerance = adaptiveTolerance;
+  tileParams.adaptiveStep = adaptiveStep;
+  if (approxMinBox > 0 && !binary){
+    fprintf(stderr, "Warning. The approximation is only available for binary images.\n");
+    fprintf(stderr, "The lacunarity is computed exactly.\n");
+    tileParams.approxMinBox = 0;
+  }
+  if (adaptiveTolerance >= 0 && plan.engine == LACUNARITY_ENGINE_INTEGRAL){
+    fprintf(stderr, "Warning. The adaptive refinement is not used with the integral engine,\n");
+    fprintf(stderr, "which computes all windows of a tile at once.\n");
+    tileParams.adaptiveTolerance = -1;
+  }
+  io.input = inBand;
+  io.output = GDALGetRasterBand(outDataset, 1);
+  io.exactOutput = (exactDataset != NULL) ? GDALGetRasterBand(exactDataset, 1) : NULL;
+  io.overviews = cog;
+  pipeline.read = gdal_io_read;
+  pipeline.readMask = raster_band_has_mask(inBand) ? gdal_io_read_mask : NULL;
+  pipeline.write = gdal_io_write;
+  pipeline.writeExact = (exactDataset != NULL) ? gdal_io_write_exact : NULL;
+  pipeline.ioArg = &io;
+  pipeline.regionX = tileX;
+  pipeline.regionY = tileY;
+  pipeline.regionW = tileW;
+  pipeline.regionH = tileH;
+  pipeline.halo = mwin - 1;
+  pipeline.tileSize = tileSize;
+  pipeline.nThreads = MAX(plan.nThreads, 1);
+  pipeline.queueDepth = MAX(plan.queueDepth, 1);
+  pipeline.verbose = 1;
+  pipeline.compute = spatial_lacunarity_tile;
+  pipeline.computeArg = &tileParams;
+  ok = pipeline_run(&pipeline);
+  
+  if (exactDataset != NULL) GDALClose(exactDataset);
+  GDALClose(outDataset);
+  GDALClose(dataset);
+  if (ok != 0){
+    fprintf(stderr, "ERROR. Unable to compute the spatial lacunarity.\n");
+    return 1;
+  }
+  
+  return 0;
+}
+
+
+
+
+
+/**
+ * Reads a window of a caller buffer, converting the pixels to long. Floating
+ * point values are rounded to the nearest integer.
+ */
+static int buffer_read (void *arg, int xOff, int yOff, int xSize, int ySize, long *data)
+{
+  const lacunarity_raster *r = (const lacunarity_raster*)arg;
+  const char *row;
+  int i, j;
+  
+  for (j = 0; j < ySize; j++){
+    row = (const char*)r->pixels + (size_t)(yOff + j) * r->stride;
+    for (i = 0; i < xSize; i++){
+      switch (r->dtype){
+        case LACUNARITY_BYTE:    *data = ((const unsigned char*)row)[xOff + i]; break;
+        case LACUNARITY_INT16:   *data = ((const short*)row)[xOff + i]; break;
+        case LACUNARITY_UINT16:  *data = ((const unsigned short*)row)[xOff + i]; break;
+        case LACUNARITY_INT32:   *data = ((const int*)row)[xOff + i]; break;
+        case LACUNARITY_UINT32:  *data = ((const unsigned int*)row)[xOff + i]; break;
+        case LACUNARITY_FLOAT32: *data = lround(((const float*)row)[xOff + i]); break;
+        case LACUNARITY_FLOAT64: *data = lround(((const double*)row)[xOff + i]); break;
+        case LACUNARITY_LONG:    *data = ((const long*)row)[xOff + i]; break;
+        default:
+          fprintf(stderr, "ERROR. Unknown pixel type %i.\n", (int)r->dtype);
+          return 1;
+      }
+      data++;
+    }
+  }
+  return 0;
+}
+
+static int buffer_read_mask (void *arg, int xOff, int yOff, int xSize, int ySize, 
+            unsigned char *mask)
+{
+  const lacunarity_raster *r = (const lacunarity_raster*)arg;
+  int j;
+  
+  for (j = 0; j < ySize; j++){
+    memcpy(mask + (size_t)j * xSize, r->mask + (size_t)(yOff + j) * r->maskStride + xOff, xSize);
+  }
+  return 0;
+}
+
+
+
+/**
+ * The caller buffers accessed by the pipeline callbacks.
+ */
+typedef struct buffer_io {
+  const lacunarity_raster *input;
+  double *output;
+  size_t outputStride;
+} buffer_io;
+
+static int buffer_io_read (void *arg, int xOff, int yOff, int xSize, int ySize, long *data)
+{
+  return buffer_read((void*)((buffer_io*)arg)->input, xOff, yOff, xSize, ySize, data);
+}
+
+static int buffer_io_read_mask (void *arg, int xOff, int yOff, int xSize, int ySize, 
+            unsigned char *mask)
+{
+  return buffer_read_mask((void*)((buffer_io*)arg)->input, xOff, yOff, xSize, ySize, mask);
+}
+
+static int buffer_io_write (void *arg, int xOff, int yOff, int xSize, int ySize, 
+            double *values)
+{
+  buffer_io *io = (buffer_io*)arg;
+  int j;
+  
+  for (j = 0; j < ySize; j++){
+    memcpy((char*)io->output + (size_t)(yOff + j) * io->outputStride + xOff * sizeof(double),
+           values + (size_t)j * xSize, xSize * sizeof(double));
+  }
+  return 0;
+}
+
+
+
+/**
+ * Checks the geometry of a caller buffer. Returns 0 if it can be used.
+ */
+static int check_raster (const lacunarity_raster *raster)
+{
+  static const size_t pixelSize[] = {
+    sizeof(unsigned char), sizeof(short), sizeof(unsigned short), sizeof(int),
+    sizeof(unsigned int), sizeof(float), sizeof(double), sizeof(long)
+  };
+  
+  if (raster == NULL || raster->pixels == NULL || raster->width < 1 || raster->height < 1){
+    fprintf(stderr, "ERROR. Empty input raster.\n");
+    return 1;
+  }
+  if ((int)raster->dtype < 0 || (int)raster->dtype > LACUNARITY_LONG){
+    fprintf(stderr, "ERROR. Unknown pixel type %i.\n", (int)raster->dtype);
+    return 1;
+  }
+  if (raster->stride < raster->width * pixelSize[raster->dtype] ||
+      (raster->mask != NULL && raster->maskStride < (size_t)raster->width)){
+    fprintf(stderr, "ERROR. The row stride is smaller than the raster width.\n");
+    return 1;
+  }
+  return 0;
+}
+
+
+
+/**
+ * Returns non-zero if a caller buffer can be used without copying: native
+ * long pixels, rows aligned on long, no mask and no binary conversion.
+ */
+static int use_without_copy (const lacunarity_raster *raster, int binary)
+{
+  return raster->dtype == LACUNARITY_LONG && raster->stride % sizeof(long) == 0 &&
+         raster->mask == NULL && !binary;
+}
+
+
+
+int lacunarity_curve (const lacunarity_raster *raster,
+        int binary, long binaryThreshold, int f3d,
+        int gbox_min, int gbox_max, int gbox_step,
+        int approxMinBox, lacunarity_exec *exec, double *curve)
+{
+  lacunarity_exec defaults;
+  long *data;
+  unsigned char *mask;
+  long nPixels;
+  int ok;
+  
+  if (exec == NULL){
+    lacunarity_exec_defaults(&defaults);
+    exec = &defaults;
+  }
+  if (check_raster(raster) != 0) return 1;
+  if (gbox_step < 1 || gbox_min < 1 || gbox_min > gbox_max){
+    fprintf(stderr, "ERROR. Invalid range of gliding box sizes.\n");
+    return 1;
+  }
+  
+  // Native long pixels are read in place, with the row stride as pitch.
+  if (use_without_copy(raster, binary)){
+    return lacunarity_curve_data((long*)raster->pixels, NULL, 
+             (int)(raster->stride / sizeof(long)), raster->width, raster->height, 
+             binary, f3d, gbox_min, gbox_max, gbox_step, approxMinBox, exec->engine, curve, NULL);
+  }
+  
+  // Otherwise, the pixels are converted into a contiguous copy.
+  nPixels = (long)raster->width * raster->height;
+  data = (long*)malloc(nPixels * sizeof(long));
+  mask = NULL;
+  if (raster->mask != NULL) mask = (unsigned char*)malloc(nPixels);
+  if (data == NULL || (raster->mask != NULL && mask == NULL)){
+    fprintf(stderr, "ERROR. Not enough memory for the input raster.\n");
     free(data);
+    free(mask);
+    return 1;
+  }
+  ok = buffer_read((void*)raster, 0, 0, raster->width, raster->height, data);
+  if (ok == 0 && mask != NULL){
+    ok = buffer_read_mask((void*)raster, 0, 0, raster->width, raster->height, mask);
+  }
+  if (ok == 0){
+    prepare_input_data(data, mask, nPixels, binary, binaryThreshold);
+    ok = lacunarity_curve_data(data, mask, raster->width, raster->width, raster->height, 
+           binary, f3d, gbox_min, gbox_max, gbox_step, approxMinBox, exec->engine, curve, NULL);
+  }
+  free(data);
+  free(mask);
+  return ok;
+}
+
+
+
+int lacunarity_threshold_curves (const lacunarity_raster *raster,
+        long *thresholds, int nThresholds,
+        int gbox_min, int gbox_max, int gbox_step,
+        double *curves)
+{
+  long *data;
+  unsigned char *mask;
+  long nPixels;
+  int ok;
+  
+  if (check_raster(raster) != 0) return 1;
+  if (gbox_step < 1 || gbox_min < 1 || gbox_min > gbox_max || nThresholds < 1){
+    fprintf(stderr, "ERROR. Invalid range of gliding box sizes.\n");
     return 1;
   }
   
+  // The integral images are built from a contiguous copy.
+  nPixels = (long)raster->width * raster->height;
+  data = (long*)malloc(nPixels * sizeof(long));
+  mask = NULL;
+  if (raster->mask != NULL) mask = (unsigned char*)malloc(nPixels);
+  if (data == NULL || (raster->mask != NULL && mask == NULL)){
+    fprintf(stderr, "ERROR. Not enough memory for the input raster.\n");
+    free(data);
+    free(mask);
+    return 1;
+  }
+  ok = buffer_read((void*)raster, 0, 0, raster->width, raster->height, data);
+  if (ok == 0 && mask != NULL){
+    ok = buffer_read_mask((void*)raster, 0, 0, raster->width, raster->height, mask);
+  }
+  if (ok == 0){
+    ok = threshold_curves_data(data, mask, raster->width, raster->height, 
+           thresholds, nThresholds, gbox_min, gbox_max, gbox_step, curves);
+  }
   free(data);
-  return 0;
+  free(mask);
+  return ok;
 }
 
 
 
+int spatial_lacunarity_map (const lacunarity_raster *raster,
+            int binary, long binaryThreshold, int f3d,
+            int gbox, int mwin, int approxMinBox,
+            lacunarity_exec *exec,
+            double *map, size_t mapStride)
+{
+  lacunarity_exec defaults;
+  spatial_tile_params tileParams;
+  pipeline_params pipeline;
+  buffer_io io;
+  
+  if (exec == NULL){
+    lacunarity_exec_defaults(&defaults);
+    exec = &defaults;
+  }
+  if (check_raster(raster) != 0) return 1;
+  if (gbox < 1 || mwin < 1){
+    fprintf(stderr, "ERROR. Invalid gliding box or moving window size.\n");
+    return 1;
+  }
+  if (raster->width < mwin || raster->height < mwin){
+    fprintf(stderr, "ERROR. The moving window is larger than the input raster.\n");
+    return 1;
+  }
+  if (mapStride < (raster->width - mwin + 1) * sizeof(double)){
+    fprintf(stderr, "ERROR. The row stride is smaller than the output width.\n");
+    return 1;
+  }
+  
+  tileParams.binary = binary;
+  tileParams.binaryThreshold = binaryThreshold;
+  tileParams.f3d = f3d;
+  tileParams.gbox = gbox;
+  tileParams.mwin = mwin;
+  tileParams.approxMinBox = binary ? approxMinBox : 0;
+  tileParams.engine = exec->engine;
+  tileParams.direct = use_without_copy(raster, binary) ? raster : NULL;
+  tileParams.adaptiveTolerance = -1;
+  tileParams.adaptiveStep = 0;
+  io.input = raster;
+  io.output = map;
+  io.outputStride = mapStride;
+  
+  // The same pipeline as for files, reading from and writing to the
+  // caller buffers. Without copying, the tiles are not read at all.
+  pipeline.read = (tileParams.direct != NULL) ? NULL : buffer_io_read;
+  pipeline.readMask = (raster->mask != NULL) ? buffer_io_read_mask : NULL;
+  pipeline.write = buffer_io_write;
+  pipeline.writeExact = NULL;
+  pipeline.ioArg = &io;
+  pipeline.regionX = 0;
+  pipeline.regionY = 0;
+  pipeline.regionW = raster->width - mwin + 1;
+  pipeline.regionH = raster->height - mwin + 1;
+  pipeline.halo = mwin - 1;
+  pipeline.tileSize = MAX(exec->tileSize, 1);
+  pipeline.nThreads = MAX(exec->nThreads, 1);
+  pipeline.queueDepth = MAX(exec->queueDepth, 1);
+  pipeline.verbose = 0;
+  pipeline.compute = spatial_lacunarity_tile;
+  pipeline.computeArg = &tileParams;
+  return pipeline_run(&pipeline);
+}
+
+
+
+
+
+
+/**
+ * Intensity sum kernels of the layered mode, specialised at compile time
+ * for the most common gliding box sizes. With a constant box size, the
+ * pixels of the box are gathered into a small local array, and the loops
+ * over the box have constant bounds, so the compiler can unroll and
+ * vectorise them. The kernels add the same values to the intensity sums as
+ * the generic loops in lacunarity_in_window(), hence give identical results.
+ * As they loop over the box once per level, they are only faster for few
+ * levels: on a 400x400 raster, binary spatial runs take about half the
+ * time, while 51 levels are about 15% slower and the 3D mode (with its
+ * maxValue levels) was twice as slow.
+ */
+#define BOX_KERNEL_MAX_LEVELS 8
+
+#define BOX_KERNEL(G) \
+static void box_intensity_sums_##G (long *imgPtr, int rasterX, long nLevels, \
+            long *intensitySumPtr) \
+{ \
+  int px[G*G];                        /* The pixel values of the gliding box. */ \
+  int gbx, gby, n; \
+  long k, sum, v; \
+  \
+  for (gby = 0; gby < G; gby++){ \
+    for (gbx = 0; gbx < G; gbx++){ \
+      px[gby*G + gbx] = (int)imgPtr[gby*rasterX + gbx]; \
+    } \
+  } \
+  \
+  /* Level k takes the part of the pixel value between k*gbox and */ \
+  /* (k+1)*gbox. */ \
+  for (k = 0; k < nLevels; k++){ \
+    sum = 0; \
+    for (n = 0; n < G*G; n++){ \
+      v = px[n] - k*G; \
+      sum += (v <= 0) ? 0 : ((v >= G) ? G : v); \
+    } \
+    intensitySumPtr[k] += sum; \
+  } \
+}
+
+BOX_KERNEL(3)
+BOX_KERNEL(5)
+BOX_KERNEL(7)
+BOX_KERNEL(9)
+BOX_KERNEL(11)
+
+typedef void (*box_kernel_fn) (long *imgPtr, int rasterX, long nLevels, 
+            long *intensitySumPtr);
+
+/**
+ * Returns the specialised kernel for the given gliding box size and
+ * number of levels, or NULL if the generic loops have to be used.
+ */
+static box_kernel_fn box_kernel_for_size (int gbox, int f3d, long nLevels)
+{
+  if (f3d || nLevels > BOX_KERNEL_MAX_LEVELS) return NULL;
+  switch (gbox){
+    case 3:  return box_intensity_sums_3;
+    case 5:  return box_intensity_sums_5;
+    case 7:  return box_intensity_sums_7;
+    case 9:  return box_intensity_sums_9;
+    case 11: return box_intensity_sums_11;
+    default: return NULL;
+  }
+}
+
+
+
+
+/**
+ * Returns the size in bytes of the narrowest unsigned counter type able to
+ * hold intensity sums up to the given bound.
+ */
+static int intensity_counter_size (unsigned long maxBoxSum)
+{
+  if (maxBoxSum <= 0xFFUL) return 1;
+  if (maxBoxSum <= 0xFFFFUL) return 2;
+  if (maxBoxSum <= 0xFFFFFFFFUL) return 4;
+  return 8;
+}
+
+/**
+ * Loops over the intensity sum table for a given counter type T. They
+ * expect the local variables of lacunarity_in_window().
+ */
+#define INTENSITY_STORE(T) { \
+  T *tablePtr = (T*)intensitySum + boxOffset; \
+  for (k = 0; k < nLevels; k++) tablePtr[k] = (T)boxSums[k]; \
+}
+#define INTENSITY_MAX(T) { \
+  T *tablePtr = (T*)intensitySum; \
+  maxIntensity = 0; \
+  for (i = 0; i < (nGlidingBoxes * nLevels); i++){ \
+    if (maxIntensity < tablePtr[i]) maxIntensity = tablePtr[i]; \
+  } \
+}
+#define INTENSITY_HISTOGRAM(T) { \
+  T *tablePtr = (T*)intensitySum; \
+  for (i = 0; i < (nGlidingBoxes * nLevels); i++){ \
+    probDens[tablePtr[i]] += 1.0; \
+  } \
+}
 
 
 
@@ -134,6 +1617,18 @@ double lacunarity_in_window (
   int f3d, int gbox, 
   int mwinX, int mwinY, int mwinW, int mwinH)
 {
+  return lacunarity_in_masked_window(data, NULL, rasterX, rasterY, f3d, gbox, 
+           mwinX, mwinY, mwinW, mwinH);
+}
+
+
+
+
+double lacunarity_in_masked_window (
+  long *data, unsigned int *invalidSum, int rasterX, int rasterY, 
+  int f3d, int gbox, 
+  int mwinX, int mwinY, int mwinW, int mwinH)
+{
 
   double lacunarity;                  // The resulting lacunarity.
   long *imgPtr;                       // This will be our pointer for looping through our data.
@@ -143,14 +1638,27 @@ double lacunarity_in_window (
   int nGlidingBoxes;                  // Number of gliding boxes.
   long maxValue;                      // Maximum value in the whole moving window.
   long nLevels;                       // The number of levels.
-  long *intensitySum;                 // Table of the sum of intensity values.
-  long *intensitySumPtr;              // Pointer to the above table.
-  long intensitySumValue;             // The intensity sum value.
-  long maxIntensity;                  // Maximum value for intensity.
+  void *intensitySum;                 // Table of the sum of intensity values.
+  int counterSize;                    // Size in bytes of the values in this table.
+  unsigned long maxBoxSum;            // Upper bound for the values in this table.
+  long *boxSums;                      // The intensity sums of the current gliding box.
+  long *intensitySumPtr;              // Pointer to the above sums.
+  long boxOffset;                     // Offset of the current gliding box in the table.
+  unsigned long maxIntensity;         // Maximum value for intensity.
+  unsigned long v;                    // Intensity value.
   int gbx, gby;                       // Coordinates for the gliding box (x and y).
   double *probDens;                   // Pointer to the probability density table.
   double *probDensPtr;
   double M, M2;                       // The distribution moments.
+  box_kernel_fn kernel;               // Specialised kernel for the gliding box size.
+  int nValidBoxes;                    // Number of gliding boxes without nodata pixels.
+  
+  // Skip windows without any valid pixel right away.
+  if (invalidSum != NULL && 
+      invalid_pixels_in_window(invalidSum, rasterX, mwinX, mwinY, mwinW, mwinH) 
+        == (unsigned long long)mwinW * mwinH){
+    return LACUNARITY_NODATA;
+  }
   
   // Place a pointer at the start of the data.
   imgPtr = data;
@@ -192,27 +1700,51 @@ double lacunarity_in_window (
   // We need to allocate the necessary memory for this table. The size of 
   // the table is (number of levels) by (number of gliding boxes).
   nGlidingBoxes = nGlidingStepsX * nGlidingStepsY;
-  intensitySum = calloc((nLevels * nGlidingBoxes), sizeof(int));
-  if (intensitySum == NULL){
+  
+  // Every pixel adds at most min(maxValue, gbox) to the sum of a level,
+  // hence the sums are bounded by gbox * gbox * min(maxValue, gbox). We
+  // store them with the narrowest unsigned counter type holding this bound,
+  // which is one byte for binary images with gbox <= 15, and two bytes
+  // for grayscale images with gbox <= 40.
+  maxBoxSum = (unsigned long)gbox * gbox * MIN(maxValue, gbox);
+  counterSize = intensity_counter_size(maxBoxSum);
+  intensitySum = calloc((size_t)nLevels * nGlidingBoxes, counterSize);
+  boxSums = (long*)malloc(nLevels * sizeof(long));
+  if (intensitySum == NULL || boxSums == NULL){
     fprintf(stderr, "ERROR. Not enough memory for summing up the intensity values.\n");
-    return 0;
+    free(intensitySum);
+    free(boxSums);
+    return LACUNARITY_ERROR;
   }
   
   // Compute the intensity sum table.
+  // Gliding boxes touching nodata pixels are left out, the table only
+  // holds the valid boxes.
+  kernel = box_kernel_for_size(gbox, f3d, nLevels);
+  nValidBoxes = 0;
   // Loop in y direction.
   for (j = 0; j < nGlidingStepsY; j++){
     // Loop in x direction; loops faster.
     for (i = 0; i < nGlidingStepsX; i++){
       
+      if (invalidSum != NULL && 
+          INVALID_COUNT(invalidSum, rasterX, mwinX+i, mwinY+j, mwinX+i+gbox, mwinY+j+gbox) > 0){
+        continue;
+      }
+      
       // Place the image pointer at the start of the data.
       imgPtr = data;
       imgPtr += ((mwinY+j)*rasterX) + (mwinX+i);
       
-      // Place the pointer at the start of the intensity sum table.
-      intensitySumPtr = intensitySum + (((j * nGlidingStepsX) + i)  * nLevels);
+      // The sums of this gliding box are computed in boxSums, and then
+      // stored in the intensity sum table.
+      intensitySumPtr = boxSums;
+      memset(boxSums, 0, nLevels * sizeof(long));
       
       // Loop through all cells of the gliding box.
-      if (f3d){
+      if (kernel != NULL){
+        kernel(imgPtr, rasterX, nLevels, intensitySumPtr);
+      }else if (f3d){
         // Here comes the loop for the true 3D gliding box. In this case, the number of levels
         // is the same as the maximum value, and for each step, we sum up all the values 
         // as in 2D case.
@@ -220,7 +1752,7 @@ double lacunarity_in_window (
           for (gbx = 0; gbx < gbox; gbx++){
             c = *imgPtr;
             for (k = 0; k < nLevels; k++){
-              *intensitySumPtr += MIN((c-k), gbox);
+              *intensitySumPtr += MAX(MIN((c-k), gbox), 0);
               intensitySumPtr++;
             }
             imgPtr++;
@@ -238,7 +1770,7 @@ double lacunarity_in_window (
               if (c >= gbox){
                 *intensitySumPtr += gbox;
                 c -= gbox;
-              }else{
+              }else if (c > 0){
                 *intensitySumPtr += c;
                 c = 0;
               }
@@ -251,18 +1783,34 @@ double lacunarity_in_window (
           imgPtr += (rasterX - gbox);
         }
       }
+      
+      // Store the sums in the table.
+      boxOffset = (long)nValidBoxes * nLevels;
+      nValidBoxes++;
+      switch (counterSize){
+        case 1: INTENSITY_STORE(unsigned char); break;
+        case 2: INTENSITY_STORE(unsigned short); break;
+        case 4: INTENSITY_STORE(unsigned int); break;
+        default: INTENSITY_STORE(unsigned long long); break;
+      }
     }  // for (unsigned short i = 0; i < nGlidingSteps; i++)
   }  // for (unsigned short j = 0; j < nGlidingSteps; j++)
   
+  // Only the valid gliding boxes count for the probability density.
+  nGlidingBoxes = nValidBoxes;
+  if (nGlidingBoxes == 0){
+    free(intensitySum);
+    free(boxSums);
+    return LACUNARITY_NODATA;
+  }
+  
   
 //  // --- DEBUG ---
 //  FILE *pFile = fopen("/Temp/lacunarity_intensity.txt", "w");
-//  intensitySumPtr = intensitySum;
 //  for (i = 0; i < (nLevels * nGlidingBoxes); i++)
 //  {
-//    int intensity = *intensitySumPtr;
+//    int intensity = ((unsigned short*)intensitySum)[i];
 //    fprintf(pFile, "%i\n", intensity);
-//    intensitySumPtr++;
 //  }
 //  fclose(pFile);  
 //  // --- END DEBUG ---
@@ -271,34 +1819,31 @@ double lacunarity_in_window (
   // Compute the probability density for the intensity sum table.
   
   // Find first the maximum intensity value.
-  maxIntensity = 0;
-  intensitySumPtr = intensitySum;
-  for (i = 0; i < (nGlidingBoxes * nLevels); i++){
-    intensitySumValue = *intensitySumPtr;
-    if (maxIntensity < intensitySumValue){
-      maxIntensity = intensitySumValue;
-    }
-    intensitySumPtr++;
+  switch (counterSize){
+    case 1: INTENSITY_MAX(unsigned char); break;
+    case 2: INTENSITY_MAX(unsigned short); break;
+    case 4: INTENSITY_MAX(unsigned int); break;
+    default: INTENSITY_MAX(unsigned long long); break;
   }
   // Allocate a table for the probability density values.
   probDens = calloc((maxIntensity+1), sizeof(double));
   if (probDens == NULL){
     fprintf(stderr, "ERROR. Not enough memory to compute probability density values.\n");
-    return 0;
+    free(intensitySum);
+    free(boxSums);
+    return LACUNARITY_ERROR;
   }
   
-  intensitySumPtr = intensitySum;
-  
   // Fill the probability density table.
-  for (i = 0; i < (nGlidingBoxes * nLevels); i++){
-    probDensPtr = probDens + *intensitySumPtr;
-    double pd = *probDensPtr + 1.0;
-    *probDensPtr = pd;
-    intensitySumPtr++;
-  }  
+  switch (counterSize){
+    case 1: INTENSITY_HISTOGRAM(unsigned char); break;
+    case 2: INTENSITY_HISTOGRAM(unsigned short); break;
+    case 4: INTENSITY_HISTOGRAM(unsigned int); break;
+    default: INTENSITY_HISTOGRAM(unsigned long long); break;
+  }
   // Normalisation of the probability density table.
   probDensPtr = probDens;
-  for (i = 0; i < (maxIntensity + 1); i++){
+  for (v = 0; v < (maxIntensity + 1); v++){
     *probDensPtr = *probDensPtr / (nGlidingBoxes * nLevels);
     probDensPtr++;
   }
@@ -319,18 +1864,18 @@ double lacunarity_in_window (
   M = 0;
   M2 = 0;
   probDensPtr = probDens;
-  for (i = 0; i < (maxIntensity+1); i++){
+  for (v = 0; v < (maxIntensity+1); v++){
     //double probability, MTemp;
     //probability = *probDensPtr;
     //MTemp = i * probability;
-    M += i * (*probDensPtr);
+    M += v * (*probDensPtr);
     //M += MTemp;
-    M2 += (i * i) * (*probDensPtr);
+    M2 += ((double)v * v) * (*probDensPtr);
     probDensPtr++;
   }
   
   // Compute the lacunarity index.
-  lacunarity = (M2 / (M * M));
+  lacunarity = lacunarity_from_moments(M, M2);
   
   //  // --- DEBUG ---
   //  FILE *pFile = fopen("/lacunarity.txt", "w");
@@ -340,6 +1885,7 @@ double lacunarity_in_window (
   //  fclose(pFile);  
   //  // --- END DEBUG ---  
   free(intensitySum);
+  free(boxSums);
   free(probDens);
   
   return lacunarity;
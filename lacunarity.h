@@ -1,17 +1,257 @@
+#ifndef LACUNARITY_H
+#define LACUNARITY_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+
+/**
+ * The smaller and the larger of two values.
+ */
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+
+
+/**
+ * The number of approximated gliding box sizes for which the deviation
+ * from the exact lacunarity is reported.
+ */
+#define APPROX_CALIBRATION_SIZES 3
+
+/**
+ * The engines computing the exact lacunarity. Both give the same results.
+ */
+typedef enum lacunarity_engine {
+  LACUNARITY_ENGINE_HISTOGRAM,  // Sums the levels of every box pixel by pixel,
+                                // and builds the histogram of these sums.
+  LACUNARITY_ENGINE_INTEGRAL,   // Sums the levels using an integral image per
+                                // level, in O(1) per box whatever its size.
+  LACUNARITY_ENGINE_AUTO        // Chosen by the planner if there is a memory
+                                // budget, the histogram engine otherwise.
+} lacunarity_engine;
+
+/**
+ * Options controlling how the lacunarity is executed. They do not change
+ * the result.
+ */
+typedef struct lacunarity_exec {
+  int shard;          // The shard to compute (0 to nShards-1).
+  int nShards;        // The number of shards the output is split into.
+  int nThreads;       // The number of compute threads.
+  int tileSize;       // The size of the tiles processed by the pipeline.
+  int queueDepth;     // The number of tiles waiting between pipeline stages.
+  lacunarity_engine engine;   // The engine computing the exact values.
+  size_t maxMemory;   // The memory budget in bytes, or 0 for no budget.
+                      // With a budget, the options above are only upper
+                      // bounds for the plan chosen.
+  char *cacheFile;    // The cache file of the decoded input band (see
+                      // raster_cache.h), or NULL. Used by lacunarity().
+} lacunarity_exec;
+
+/**
+ * Sets the default execution options: a single shard, one compute thread
+ * per CPU, tiles of 256x256 pixels, double buffering between stages,
+ * the histogram engine, no memory budget and no cache file.
+ */
+void lacunarity_exec_defaults (lacunarity_exec *exec);
+
+/**
+ * Computes the lacunarity for a range of gliding box sizes and prints it
+ * to stdout.
+ * For binary images, gliding boxes of at least approxMinBox pixels are
+ * evaluated on a coarser level of a sum-preserving pyramid, and the
+ * deviation from the exact values is reported for the smallest of them.
+ * An approxMinBox of 0 computes all sizes exactly.
+ * With a cache file in exec, the prepared band is mapped from the cache
+ * if it matches the run, and the cache is written otherwise.
+ */
 int lacunarity (char *input_raster, int band, 
         int binary, long binaryThreshold, int f3d,
+        int gbox_min, int gbox_max, int gbox_step,
+        int approxMinBox, lacunarity_exec *exec);
+
+/**
+ * Computes the binary lacunarity for a range of gliding box sizes and
+ * several binary thresholds in a single pass over the raster, and prints
+ * it to stdout as one table with a column per threshold.
+ */
+int lacunarity_thresholds (char *input_raster, int band, 
+        long *thresholds, int nThresholds,
         int gbox_min, int gbox_max, int gbox_step);
 
+/**
+ * Computes the spatial lacunarity using a moving window and writes it to
+ * a georeferenced output raster.
+ * The output can be split into nShards tiles; only the tile of the given
+ * shard (0 to nShards-1) is read (with a halo of mwin-1 pixels), computed
+ * and written. The tiles can later be assembled using raster_merge().
+ * Reading, computing and writing run concurrently on smaller tiles.
+ * As for lacunarity(), a gliding box of at least approxMinBox pixels on a
+ * binary image is approximated on a pyramid level (0 disables this).
+ * With a non-negative adaptiveTolerance, the windows are first computed on
+ * a grid with a spacing of adaptiveStep pixels. A grid cell whose corner
+ * values differ by more than the tolerance (or include nodata) is split
+ * and refined recursively; the other windows are interpolated bilinearly.
+ * This is only used with the histogram engine and without approximation.
+ * If exact_file is not NULL, a byte raster flagging the windows computed
+ * exactly (1) rather than interpolated or approximated (0) is written to it.
+ */
 int spatial_lacunarity (char *input_raster, int band, 
             int binary, long binaryThreshold, int f3d,
-            int gbox, int mwin, 
-            char *output_file, char *format);
+            int gbox, int mwin, int approxMinBox,
+            double adaptiveTolerance, int adaptiveStep,
+            lacunarity_exec *exec,
+            char *output_file, char *exact_file, char *format);
+
+/**
+ * Chooses the tile grid (nTilesX by nTilesY tiles) used to split an output
+ * raster of the given size into nShards tiles.
+ */
+void shard_tile_grid (int nShards, int outRasterX, int outRasterY, 
+            int *nTilesX, int *nTilesY);
+
+/**
+ * The lacunarity value given to windows without any valid gliding box,
+ * i.e. where every gliding box touches a nodata or masked pixel.
+ */
+#define LACUNARITY_NODATA -1.0
+
+/**
+ * The value returned by the functions computing the lacunarity of a window
+ * if they fail, e.g. for lack of memory. It is never a valid lacunarity.
+ */
+#define LACUNARITY_ERROR -2.0
+
+/**
+ * Returns the lacunarity M2 / M^2 of the box masses from their moments
+ * M and M2. If all valid gliding boxes are empty (M is 0), the lacunarity
+ * is 0, as for a window without any value; all engines use this rule.
+ */
+double lacunarity_from_moments (double M, double M2);
+
+/**
+ * Computes the integral image of the invalid pixels of a validity mask
+ * (0 marks an invalid pixel). The image has (rasterX+1) * (rasterY+1)
+ * values, the first row and column being 0.
+ * Returns NULL in case of an error.
+ */
+unsigned int *invalid_integral_image (unsigned char *mask, int rasterX, int rasterY);
+
+/**
+ * Returns the number of invalid pixels in the window of w x h pixels at
+ * x0/y0 from the integral image of the invalid pixels. The count is exact
+ * for windows of any size, including those of 2^32 pixels or more.
+ */
+unsigned long long invalid_pixels_in_window (unsigned int *invalidSum, int rasterX,
+            int x0, int y0, int w, int h);
 
 /**
  * Computes the lacunarity index inside a given window, for a given
- * gliding box size.
+ * gliding box size, leaving out the gliding boxes touching invalid pixels.
+ * invalidSum is the integral image of the invalid pixels of the whole data
+ * array (see invalid_integral_image), or NULL if all pixels are valid.
+ * Returns LACUNARITY_NODATA if there is no valid gliding box, and
+ * LACUNARITY_ERROR in case of an error.
+ */
+double lacunarity_in_masked_window (long *data, unsigned int *invalidSum, 
+               int rasterX, int rasterY, 
+               int f3d,
+               int gbox, 
+               int mwinX, int mwinY, int mwinW, int mwinH);
+
+/**
+ * Computes the lacunarity index inside a given window, for a given
+ * gliding box size. Returns LACUNARITY_ERROR in case of an error.
  */
 double lacunarity_in_window (long *data, int rasterX, int rasterY, 
                int f3d,
                int gbox, 
                int mwinX, int mwinY, int mwinW, int mwinH);
+
+
+
+/**
+ * The pixel types of rasters held in memory.
+ */
+typedef enum lacunarity_dtype {
+  LACUNARITY_BYTE,
+  LACUNARITY_INT16,
+  LACUNARITY_UINT16,
+  LACUNARITY_INT32,
+  LACUNARITY_UINT32,
+  LACUNARITY_FLOAT32,   // Floating point values are rounded to integers.
+  LACUNARITY_FLOAT64,
+  LACUNARITY_LONG       // Native long, used in place where possible.
+} lacunarity_dtype;
+
+/**
+ * A raster held in memory by the caller; it is only read. The rows are
+ * stride bytes apart. The optional validity mask has one byte per pixel,
+ * 0 marking a nodata pixel, and rows maskStride bytes apart.
+ * Native long pixels with rows aligned on long are used without copying,
+ * unless there is a mask or the image is converted to binary.
+ */
+typedef struct lacunarity_raster {
+  const void *pixels;
+  lacunarity_dtype dtype;
+  int width, height;
+  size_t stride;
+  const unsigned char *mask;    // NULL if all pixels are valid.
+  size_t maskStride;
+} lacunarity_raster;
+
+/**
+ * Computes the lacunarity curve of an in-memory raster, as lacunarity()
+ * does for a raster file. curve receives one value per gliding box size,
+ * i.e. (gbox_max - gbox_min) / gbox_step + 1 values. exec may be NULL
+ * for the default options.
+ * Nothing is printed to stdout. Returns 0 in case of success, or a non-zero
+ * value for invalid arguments or if the curve cannot be computed (e.g. for
+ * lack of memory).
+ */
+int lacunarity_curve (const lacunarity_raster *raster,
+        int binary, long binaryThreshold, int f3d,
+        int gbox_min, int gbox_max, int gbox_step,
+        int approxMinBox, lacunarity_exec *exec, double *curve);
+
+/**
+ * Computes the binary lacunarity curves of an in-memory raster for several
+ * thresholds, as lacunarity_thresholds() does for a raster file. curves
+ * receives nThresholds values (one per threshold) per gliding box size.
+ * Nothing is printed to stdout. Returns 0 in case of success.
+ */
+int lacunarity_threshold_curves (const lacunarity_raster *raster,
+        long *thresholds, int nThresholds,
+        int gbox_min, int gbox_max, int gbox_step,
+        double *curves);
+
+/**
+ * Computes the spatial lacunarity of an in-memory raster, as
+ * spatial_lacunarity() does for a raster file. map receives
+ * (width - mwin + 1) x (height - mwin + 1) values with rows mapStride
+ * bytes apart; windows without valid gliding box are LACUNARITY_NODATA.
+ * exec may be NULL for the default options; its shard options are ignored.
+ * Nothing is printed to stdout. Returns 0 in case of success, or a non-zero
+ * value for invalid arguments or if a window cannot be computed (e.g. for
+ * lack of memory).
+ */
+int spatial_lacunarity_map (const lacunarity_raster *raster,
+            int binary, long binaryThreshold, int f3d,
+            int gbox, int mwin, int approxMinBox,
+            lacunarity_exec *exec,
+            double *map, size_t mapStride);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
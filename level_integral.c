@@ -0,0 +1,229 @@
+#include "level_integral.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+
+
+/**
+ * Returns the sum over the rectangle x0 <= x < x1, y0 <= y < y1 of an
+ * integral image with rows width+1 values apart. The integral images use
+ * unsigned arithmetic, so that the sums are exact even if they wrap around.
+ */
+#define RECT_SUM(ii, width, x0, y0, x1, y1) \
+  (ii[(long)(y1)*((width)+1) + (x1)] - ii[(long)(y0)*((width)+1) + (x1)] - \
+   ii[(long)(y1)*((width)+1) + (x0)] + ii[(long)(y0)*((width)+1) + (x0)])
+
+
+
+/**
+ * Builds the integral image of the contributions of the pixels to level k.
+ */
+static void level_image (long *data, int pitch, int rasterX, int rasterY,
+            int f3d, int gbox, long k, unsigned long long *integral)
+{
+  unsigned long long rowSum;
+  long v;
+  int i, j;
+
+  for (j = 0; j < rasterY; j++){
+    rowSum = 0;
+    for (i = 0; i < rasterX; i++){
+      v = data[(long)j*pitch + i] - (f3d ? k : k*gbox);
+      rowSum += (v <= 0) ? 0 : ((v >= gbox) ? gbox : v);
+      integral[(long)(j+1)*(rasterX+1) + i+1] = integral[(long)j*(rasterX+1) + i+1] + rowSum;
+    }
+  }
+}
+
+
+
+/**
+ * Returns 1 if the sum of the squared box masses over the boxes of a window
+ * on one level may not fit into 64 bits. A box adds at most gbox per pixel.
+ */
+static int level_sum_may_wrap (int gbox, int winBoxX, int winBoxY)
+{
+  long double maxMass;
+
+  maxMass = (long double)gbox * gbox * gbox;
+  return maxMass * maxMass * winBoxX * winBoxY >= 18446744073709551615.0L;
+}
+
+
+
+int level_integral_lacunarity (long *data, int pitch, unsigned int *invalidSum,
+            int rasterX, int rasterY,
+            int f3d, int gbox, int mwinW, int mwinH,
+            double *lacunarity)
+{
+  int nOutX, nOutY;             // Number of moving windows in each direction.
+  int boxX, boxY;               // Number of gliding box positions in the array.
+  int winBoxX, winBoxY;         // Number of gliding box positions in a window.
+  long nOut, n;
+  unsigned long long *levelSum; // Integral image of the level contributions.
+  unsigned long long *massSum;  // Integral image of the box masses.
+  unsigned long long *mass2Sum; // Integral image of the squared box masses.
+  unsigned long long *validSum; // Integral image of the valid boxes.
+  long double *S1, *S2;         // Moments of the box masses per window.
+  unsigned long long *nValidBoxes; // Number of valid boxes per window.
+  long *nLevels;                // Number of levels per window.
+  unsigned long long mass, rowMass, rowMass2, rowValid;
+  long double levelS1, levelS2;
+  long maxValue, maxLevels, k;
+  int i, j, x, y, anyLevel, direct;
+
+  nOutX = rasterX - mwinW + 1;
+  nOutY = rasterY - mwinH + 1;
+  if (nOutX < 1 || nOutY < 1) return 0;
+  nOut = (long)nOutX * nOutY;
+
+  // Without any gliding box fitting into the windows, no window is valid.
+  if (gbox < 1 || gbox > mwinW || gbox > mwinH){
+    for (n = 0; n < nOut; n++) lacunarity[n] = LACUNARITY_NODATA;
+    return 0;
+  }
+  boxX = rasterX - gbox + 1;
+  boxY = rasterY - gbox + 1;
+  winBoxX = mwinW - gbox + 1;
+  winBoxY = mwinH - gbox + 1;
+
+  // The integral images of the masses only pay off with several windows,
+  // and their sums per window and level are exact as long as they fit into
+  // 64 bits. Otherwise, the masses of the boxes of each window are summed
+  // up directly.
+  direct = (nOut == 1 || level_sum_may_wrap(gbox, winBoxX, winBoxY));
+
+  levelSum = (unsigned long long*)calloc((size_t)(rasterX+1) * (rasterY+1), sizeof(unsigned long long));
+  massSum = NULL;
+  mass2Sum = NULL;
+  if (!direct){
+    massSum = (unsigned long long*)calloc((size_t)(boxX+1) * (boxY+1), sizeof(unsigned long long));
+    mass2Sum = (unsigned long long*)calloc((size_t)(boxX+1) * (boxY+1), sizeof(unsigned long long));
+  }
+  validSum = (unsigned long long*)calloc((size_t)(boxX+1) * (boxY+1), sizeof(unsigned long long));
+  S1 = (long double*)calloc(nOut, sizeof(long double));
+  S2 = (long double*)calloc(nOut, sizeof(long double));
+  nValidBoxes = (unsigned long long*)malloc(nOut * sizeof(unsigned long long));
+  nLevels = (long*)calloc(nOut, sizeof(long));
+  if (levelSum == NULL || (!direct && (massSum == NULL || mass2Sum == NULL)) || validSum == NULL ||
+      S1 == NULL || S2 == NULL || nValidBoxes == NULL || nLevels == NULL){
+    fprintf(stderr, "ERROR. Not enough memory for the level integral images.\n");
+    free(levelSum);
+    free(massSum);
+    free(mass2Sum);
+    free(validSum);
+    free(S1);
+    free(S2);
+    free(nValidBoxes);
+    free(nLevels);
+    return 1;
+  }
+
+  // Count the valid gliding boxes of every window.
+  for (j = 0; j < boxY; j++){
+    rowValid = 0;
+    for (i = 0; i < boxX; i++){
+      if (invalidSum == NULL || RECT_SUM(invalidSum, rasterX, i, j, i+gbox, j+gbox) == 0){
+        rowValid++;
+      }
+      validSum[(long)(j+1)*(boxX+1) + i+1] = validSum[(long)j*(boxX+1) + i+1] + rowValid;
+    }
+  }
+  for (j = 0; j < nOutY; j++){
+    for (i = 0; i < nOutX; i++){
+      nValidBoxes[(long)j*nOutX + i] = RECT_SUM(validSum, boxX, i, j, i+winBoxX, j+winBoxY);
+    }
+  }
+
+  // The number of levels is given by the maximum value.
+  maxValue = 0;
+  for (j = 0; j < rasterY; j++){
+    for (i = 0; i < rasterX; i++){
+      if (maxValue < data[(long)j*pitch + i]) maxValue = data[(long)j*pitch + i];
+    }
+  }
+  maxLevels = f3d ? maxValue : (maxValue + gbox - 1) / gbox;
+
+  // Stream over the levels. A window counts a level as long as it holds
+  // any contribution to it, which gives the same number of levels as its
+  // maximum value. The boxes touching invalid pixels have a mass of 0 on
+  // all levels, and are only left out in the number of boxes. The sums over
+  // the levels may exceed 64 bits, hence they are kept in long double.
+  for (k = 0; k < maxLevels; k++){
+    level_image(data, pitch, rasterX, rasterY, f3d, gbox, k, levelSum);
+    if (!direct){
+      for (j = 0; j < boxY; j++){
+        rowMass = 0;
+        rowMass2 = 0;
+        for (i = 0; i < boxX; i++){
+          mass = RECT_SUM(levelSum, rasterX, i, j, i+gbox, j+gbox);
+          if (invalidSum != NULL && RECT_SUM(validSum, boxX, i, j, i+1, j+1) == 0) mass = 0;
+          rowMass += mass;
+          rowMass2 += mass * mass;
+          massSum[(long)(j+1)*(boxX+1) + i+1] = massSum[(long)j*(boxX+1) + i+1] + rowMass;
+          mass2Sum[(long)(j+1)*(boxX+1) + i+1] = mass2Sum[(long)j*(boxX+1) + i+1] + rowMass2;
+        }
+      }
+    }
+    anyLevel = 0;
+    for (j = 0; j < nOutY; j++){
+      for (i = 0; i < nOutX; i++){
+        if (RECT_SUM(levelSum, rasterX, i, j, i+mwinW, j+mwinH) == 0) continue;
+        n = (long)j*nOutX + i;
+        nLevels[n]++;
+        if (direct){
+          levelS1 = 0;
+          levelS2 = 0;
+          for (y = j; y < j + winBoxY; y++){
+            for (x = i; x < i + winBoxX; x++){
+              if (invalidSum != NULL && RECT_SUM(validSum, boxX, x, y, x+1, y+1) == 0) continue;
+              mass = RECT_SUM(levelSum, rasterX, x, y, x+gbox, y+gbox);
+              levelS1 += mass;
+              levelS2 += (long double)mass * mass;
+            }
+          }
+          S1[n] += levelS1;
+          S2[n] += levelS2;
+        }else{
+          S1[n] += RECT_SUM(massSum, boxX, i, j, i+winBoxX, j+winBoxY);
+          S2[n] += RECT_SUM(mass2Sum, boxX, i, j, i+winBoxX, j+winBoxY);
+        }
+        anyLevel = 1;
+      }
+    }
+    if (!anyLevel) break;
+  }
+
+  // M = S1 / (boxes * levels) and M2 = S2 / (boxes * levels).
+  for (j = 0; j < nOutY; j++){
+    for (i = 0; i < nOutX; i++){
+      n = (long)j*nOutX + i;
+      if (invalidSum != NULL &&
+          invalid_pixels_in_window(invalidSum, rasterX, i, j, mwinW, mwinH) == 
+            (unsigned long long)mwinW * mwinH){
+        lacunarity[n] = LACUNARITY_NODATA;
+      }else if (nLevels[n] == 0){
+        lacunarity[n] = 0.0;
+      }else if (nValidBoxes[n] == 0){
+        lacunarity[n] = LACUNARITY_NODATA;
+      }else{
+        lacunarity[n] = lacunarity_from_moments(
+          (double)(S1[n] / ((long double)nValidBoxes[n] * nLevels[n])),
+          (double)(S2[n] / ((long double)nValidBoxes[n] * nLevels[n])));
+      }
+    }
+  }
+
+  free(levelSum);
+  free(massSum);
+  free(mass2Sum);
+  free(validSum);
+  free(S1);
+  free(S2);
+  free(nValidBoxes);
+  free(nLevels);
+  return 0;
+}
+
+
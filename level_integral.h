@@ -0,0 +1,39 @@
+/**
+ * Lacunarity engine based on per-level integral images.
+ *
+ * In the layered and 3D modes, every pixel adds a clamped part of its value
+ * to each level of a gliding box: min(max(c - k*gbox, 0), gbox) or
+ * min(max(c - k, 0), gbox). These contributions are summed into an
+ * integral image per level, so the mass of any box on a level is found in
+ * O(1), whatever the box size. The lacunarity only needs the first two
+ * moments of the masses, which are summed per moving window using integral
+ * images of the box masses and their squares; for a single window, or when
+ * these sums could exceed 64 bits, the masses are summed up directly. The
+ * levels are processed one after the other, hence only one level is held in
+ * memory.
+ * The results are the same as the ones of the intensity sum histogram in
+ * lacunarity_in_masked_window().
+ */
+
+#include "lacunarity.h"
+
+
+
+/**
+ * Computes the lacunarity of every moving window of mwinW x mwinH pixels
+ * in a data array of rasterX x rasterY pixels with rows pitch values apart.
+ * The (rasterX - mwinW + 1) x (rasterY - mwinH + 1) values are written
+ * row by row to lacunarity. A single window covering the whole array gives
+ * the global lacunarity.
+ * invalidSum is the integral image of the invalid pixels (see
+ * invalid_integral_image), or NULL if all pixels are valid; the invalid
+ * pixels must be set to 0 in the data.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+int level_integral_lacunarity (long *data, int pitch, unsigned int *invalidSum,
+            int rasterX, int rasterY,
+            int f3d, int gbox, int mwinW, int mwinH,
+            double *lacunarity);
+
+
+
@@ -7,9 +7,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 
 #include "lacunarity.h"
+#include "raster.h"
 #include "gdal.h"
 
 
@@ -20,9 +22,16 @@ static char *usage[] = {
 "      [--help]\n",
 "      [--spatial] [--3d]\n",
 "      --input input_raster [--band input_band] [--binary]\n",
-"      [--binaryThreshold 1] [--mwin 5]\n",
+"      [--binaryThreshold 1 | --binaryThresholds 1,2,...] [--mwin 5]\n",
 "      [--gbox 3] [--gboxMin 3] [--gboxMax 30] [--gboxStep 1]\n",
-"      [--output output_raster_path] [--format format]\n\n",
+"      [--approx] [--approxMinBox 64]\n",
+"      [--output output_raster_path] [--format format]\n",
+"      [--shard i/N] [--threads n] [--tileSize 256] [--queueDepth 2]\n",
+"      [--engine histogram|integral|auto] [--max-memory size]\n",
+"      [--adaptive tolerance] [--adaptiveStep 16] [--exactMask mask_path]\n",
+"      [--cache cache_path]\n",
+"   r.lacunarity --merge --output output_raster_path [--format format]\n",
+"      tile_raster [tile_raster ...]\n\n",
 "DESCRIPTION\n",
 "   The following options are available:\n\n",
 "   -h\n",
@@ -43,7 +52,10 @@ static char *usage[] = {
 "      analysis approach.\n\n",
 "   -i input_raster\n",
 "   --input input_raster\n",
-"      The raster for which we should compute the lacunarity.\n\n",
+"      The raster for which we should compute the lacunarity.\n",
+"      Nodata and masked pixels (GDAL mask band) are left out: gliding boxes\n",
+"      touching them are not counted. Where no valid gliding box is left,\n",
+"      the lacunarity is -1, which is the nodata value of the output raster.\n\n",
 "   -b band\n",
 "   --band band\n",
 "      The raster band for which we should compute the lacunarity. Default is 1.\n\n",
@@ -55,6 +67,11 @@ static char *usage[] = {
 "      than this value are converted to 0, pixels greater or equal than the\n",
 "      the threshold are converted to 1. This option is ignored if the binary\n",
 "      flag is not set. Default value is 1.\n\n",
+"   --binaryThresholds threshold,threshold,...\n",
+"      Computes the binary lacunarity for each of the given comma-separated\n",
+"      thresholds in a single pass over the raster, and prints one table with\n",
+"      a column per threshold. Implies the binary flag. This option is not\n",
+"      compatible with the spatial and the approx options.\n\n",
 "   -m moving_window_size\n",
 "   --mwin moving_window_size\n",
 "      The size of the moving window. If you specify a value for this, you must\n",
@@ -75,10 +92,87 @@ static char *usage[] = {
 "   --gboxStep gliding_box_step_size\n",
 "      If you give a value for the gboxMin and gboxMax options, you can specify\n",
 "      a step size for the gliding box size. Default is 1.\n\n",
+"   --approx\n",
+"      For binary images, approximates the lacunarity for large gliding boxes\n",
+"      on a coarser level of a sum-preserving image pyramid (each level halves\n",
+"      the resolution, its cells hold the sum of the covered pixels). A box\n",
+"      keeps at least 16 cells on the level used. The deviation from the exact\n",
+"      value is printed for the three smallest approximated box sizes.\n",
+"      Ignored for grayscale images.\n\n",
+"   --approxMinBox gliding_box_size\n",
+"      The smallest gliding box size approximated with the approx flag.\n",
+"      Implies the approx flag. Default is 64.\n\n",
 "   -o output_raster_path\n",
 "   --output output_raster_path\n",
 "      The path to the output raster file. You need to select the spatial flag\n",
 "      in order to make something useful.\n\n",
+"   --shard i/N\n",
+"      Splits the spatial lacunarity output into a grid of N tiles and only\n",
+"      computes tile i (counted from 0 to N-1). Only the tile and a halo of\n",
+"      mwin-1 pixels are read from the input raster. Each tile is written\n",
+"      as a georeferenced raster to the output path; running all N shards\n",
+"      with different output paths and merging them gives the same result as\n",
+"      a single run. This option requires the spatial flag.\n\n",
+"   --threads n\n",
+"      The number of threads computing the spatial lacunarity. Default is the\n",
+"      number of CPUs.\n\n",
+"   --tileSize size\n",
+"      The spatial lacunarity is read, computed and written in tiles of this\n",
+"      size (in output pixels) by concurrent reader, compute and writer\n",
+"      threads. Default is 256.\n\n",
+"   --queueDepth depth\n",
+"      The maximum number of tiles waiting to be computed and waiting to be\n",
+"      written. Together with the tile size and the number of threads, this\n",
+"      bounds the memory used. Default is 2 (double buffering).\n\n",
+"   --engine histogram|integral\n",
+"      The engine computing the exact lacunarity; both give the same values.\n",
+"      The histogram engine sums up the levels of each gliding box pixel by\n",
+"      pixel, in O(gbox^2) per box and level. The integral engine builds an\n",
+"      integral image of each level, one level at a time, and sums up the\n",
+"      levels of a gliding box in O(1), whatever its size. It is faster for\n",
+"      large gliding boxes on grayscale images. On binary images, the\n",
+"      histogram engine uses lists of the foreground pixels per row instead\n",
+"      when their estimated cost, which grows with the number of foreground\n",
+"      and nodata pixels rather than the area, is lower. With\n",
+"      auto, the engine is chosen by the planner (see max-memory). Default is\n",
+"      histogram, or auto if a memory budget is given.\n\n",
+"   --max-memory size\n",
+"      The memory budget, in bytes or with a K, M or G suffix (e.g. 2G).\n",
+"      Before reading the data, the memory needed by the possible plans\n",
+"      (engine, and for the spatial lacunarity the number of threads, tile\n",
+"      size and queue depth) is estimated from the raster size, its maximum\n",
+"      value, mwin and gbox. The fastest plan fitting into the budget is\n",
+"      chosen and printed; the threads, tileSize and queueDepth options are\n",
+"      upper bounds. If no plan fits, the program stops right away. The\n",
+"      GDAL block cache is not included.\n\n",
+"   --adaptive tolerance\n",
+"      Computes the spatial lacunarity adaptively: the moving windows are\n",
+"      first computed on a coarse grid (see adaptiveStep). Where the values\n",
+"      at the corners of a grid cell differ by more than the tolerance, or\n",
+"      include nodata, the cell is split and refined recursively; elsewhere\n",
+"      the windows are interpolated bilinearly from the corners. A tolerance\n",
+"      of 0 only interpolates constant cells. Only used with the histogram\n",
+"      engine and without the approx flag.\n\n",
+"   --adaptiveStep step\n",
+"      The spacing in pixels of the coarse grid of the adaptive option.\n",
+"      Default is 16.\n\n",
+"   --exactMask mask_path\n",
+"      Writes a byte raster next to the spatial lacunarity output, with the\n",
+"      same size, georeference and format, where 1 flags the windows computed\n",
+"      exactly and 0 the interpolated or approximated ones.\n\n",
+"   --cache cache_path\n",
+"      For the global lacunarity, stores the decoded band (converted to binary\n",
+"      if needed, with the nodata pixels set to 0) and its mask in a raw cache\n",
+"      file. Later runs on the same input raster, band and binary threshold\n",
+"      map this file into memory instead of decoding the raster again, and\n",
+"      concurrent runs share it in the system file cache. The cache is\n",
+"      rewritten if the input raster file changes (path, inode, size or\n",
+"      modification time) or if it was written for another band or binary\n",
+"      threshold. Input rasters which are not files are not cached.\n\n",
+"   --merge\n",
+"      Assembles the tiles given as remaining arguments (e.g. the outputs of\n",
+"      the shard option) into the output raster. With the VRT format, only a\n",
+"      virtual mosaic referencing the tiles is written.\n\n",
 "   -f format\n",
 "      Format for the output raster file. Default is HFA.\n",
 "      The following formats are supported:\n",
@@ -93,7 +187,16 @@ static char *usage[] = {
 "      GMT      : GMT NetCDF Grid Format\n",
 "      JPEG2000 : JPEG-2000\n",
 "      RST      : Idrisi Raster A.1\n",
-"      ENVI     : ENVI .hdr Labelled\n\n",
+"      ENVI     : ENVI .hdr Labelled\n",
+"      COG      : Cloud-Optimized GeoTIFF like output of the spatial\n",
+"                 lacunarity: a GeoTIFF with internal tiles, DEFLATE\n",
+"                 compression and internal overviews (the mean of the valid\n",
+"                 pixels), all written while the tiles are computed. The\n",
+"                 tileSize is rounded to a multiple of 128, and the overview\n",
+"                 factors go up to the tileSize/64, so that each tile covers\n",
+"                 whole overview tiles of 64 pixels. The overview directories\n",
+"                 are written before the image data, not in the exact COG\n",
+"                 order; use gdal_translate -of COG if this is required.\n\n",
 "REFERENCES\n",
 "   Mandelbrot, B. (1983). The fractal geometry of nature. New York: Freeman.\n",
 "   Allain, C. and Cloitre, M. (1991). Characterizing the lacunarity of random\n",
@@ -142,6 +245,20 @@ int main (int argc, const char *argv[]){
   char *output_file;        // Path to the output image file.
   char *format;          // Output image file format.
   char defaultFormat[] = "HFA";  // Default output image file format.
+  lacunarity_exec exec;      // Execution options for spatial lacunarity.
+  int merge;            // Should we merge tiles instead of computing?
+  int approx;           // Should we approximate large gliding boxes?
+  int approxMinBox;     // The smallest approximated gliding box size.
+  long *thresholds;     // The binary thresholds of the threshold list mode.
+  int nThresholds;      // The number of these thresholds (0 if not used).
+  char *token;
+  int engineSet;        // Was the engine given explicitly?
+  int shardSet;         // Was a shard given?
+  double adaptiveTolerance;  // Tolerance of the adaptive refinement, or -1.
+  int adaptiveStep;     // The coarse grid spacing of the adaptive refinement.
+  char *exact_file;     // Path to the mask of the exactly computed windows.
+  double memory;
+  char unit;
   
   int ok;
   
@@ -164,6 +281,17 @@ int main (int argc, const char *argv[]){
   gbox_step = 1;
   output_file = NULL;
   format = defaultFormat;
+  lacunarity_exec_defaults(&exec);
+  merge = 0;
+  approx = 0;
+  approxMinBox = 64;
+  thresholds = NULL;
+  nThresholds = 0;
+  engineSet = 0;
+  shardSet = 0;
+  adaptiveTolerance = -1;
+  adaptiveStep = 16;
+  exact_file = NULL;
   
   // Process command line
   while (1){
@@ -183,10 +311,24 @@ int main (int argc, const char *argv[]){
       {"gboxStep",          required_argument,  0,  't'},
       {"output",            required_argument,  0,  'o'},
       {"format",            required_argument,  0,  'f'},
+      {"shard",             required_argument,  0,  'k'},
+      {"merge",             no_argument,        0,  'M'},
+      {"threads",           required_argument,  0,  'j'},
+      {"tileSize",          required_argument,  0,  'T'},
+      {"queueDepth",        required_argument,  0,  'Q'},
+      {"approx",            no_argument,        0,  'a'},
+      {"approxMinBox",      required_argument,  0,  'A'},
+      {"binaryThresholds",  required_argument,  0,  'D'},
+      {"engine",            required_argument,  0,  'E'},
+      {"max-memory",        required_argument,  0,  'X'},
+      {"adaptive",          required_argument,  0,  'R'},
+      {"adaptiveStep",      required_argument,  0,  'S'},
+      {"exactMask",         required_argument,  0,  'e'},
+      {"cache",             required_argument,  0,  'C'},
       {0, 0, 0, 0}
     };
     
-    c = getopt_long(argc, (char**)argv, "hsi:b:nd:3m:g:p:q:t:o:f:", long_options, NULL);
+    c = getopt_long(argc, (char**)argv, "hsi:b:nd:3m:g:p:q:t:o:f:k:Mj:T:Q:aA:D:E:X:R:S:e:C:", long_options, NULL);
     
     // Detect the end of the options.
     if (c == -1) break;
@@ -253,6 +395,104 @@ int main (int argc, const char *argv[]){
       case 'f':
         format = optarg;
         break;
+      
+      case 'k':
+        if (sscanf(optarg, "%i/%i", &exec.shard, &exec.nShards) != 2){
+          fprintf(stderr, "Error. The shard must be given as i/N, e.g. 0/16.\n");
+          return 1;
+        }
+        shardSet = 1;
+        break;
+      
+      case 'M':
+        merge = 1;
+        break;
+      
+      case 'j':
+        exec.nThreads = atoi(optarg);
+        break;
+      
+      case 'T':
+        exec.tileSize = atoi(optarg);
+        break;
+      
+      case 'Q':
+        exec.queueDepth = atoi(optarg);
+        break;
+      
+      case 'a':
+        approx = 1;
+        break;
+      
+      case 'A':
+        approx = 1;
+        approxMinBox = atoi(optarg);
+        break;
+        
+      case 'D':
+        binary = 1;
+        free(thresholds);
+        thresholds = (long*)malloc((strlen(optarg) / 2 + 1) * sizeof(long));
+        if (thresholds == NULL) return 1;
+        nThresholds = 0;
+        for (token = strtok(optarg, ","); token != NULL; token = strtok(NULL, ",")){
+          thresholds[nThresholds++] = atol(token);
+        }
+        if (nThresholds == 0){
+          fprintf(stderr, "Error. The binary thresholds must be given as a list, e.g. 1,5,10.\n");
+          return 1;
+        }
+        break;
+        
+      case 'E':
+        if (strcmp(optarg, "histogram") == 0){
+          exec.engine = LACUNARITY_ENGINE_HISTOGRAM;
+        }else if (strcmp(optarg, "integral") == 0){
+          exec.engine = LACUNARITY_ENGINE_INTEGRAL;
+        }else if (strcmp(optarg, "auto") == 0){
+          exec.engine = LACUNARITY_ENGINE_AUTO;
+        }else{
+          fprintf(stderr, "Error. The engine must be histogram, integral or auto.\n");
+          return 1;
+        }
+        engineSet = 1;
+        break;
+      
+      case 'X':
+        unit = 0;
+        if (sscanf(optarg, "%lf%c", &memory, &unit) < 1 || memory <= 0){
+          fprintf(stderr, "Error. The memory budget must be a size, e.g. 512M or 2G.\n");
+          return 1;
+        }
+        if (unit == 'k' || unit == 'K') memory *= 1024.0;
+        if (unit == 'm' || unit == 'M') memory *= 1024.0 * 1024.0;
+        if (unit == 'g' || unit == 'G') memory *= 1024.0 * 1024.0 * 1024.0;
+        exec.maxMemory = (size_t)memory;
+        break;
+      
+      case 'R':
+        adaptiveTolerance = atof(optarg);
+        if (adaptiveTolerance < 0){
+          fprintf(stderr, "Error. The adaptive tolerance must not be negative.\n");
+          return 1;
+        }
+        break;
+      
+      case 'S':
+        adaptiveStep = atoi(optarg);
+        if (adaptiveStep < 1){
+          fprintf(stderr, "Error. The adaptive step must be at least 1.\n");
+          return 1;
+        }
+        break;
+      
+      case 'e':
+        exact_file = optarg;
+        break;
+      
+      case 'C':
+        exec.cacheFile = optarg;
+        break;
         
       case '?':
         return 1;
@@ -263,6 +503,17 @@ int main (int argc, const char *argv[]){
   }
   
   
+  if (merge == 1){
+    if (output_file == NULL || optind >= argc){
+      fprintf(stderr, "Error. Merging requires an output raster file and at least one tile.\n");
+      return 1;
+    }
+    GDALAllRegister();
+    ok = raster_merge((char**)(argv + optind), argc - optind, output_file, format);
+    fprintf(stdout, "r.lacunarity done.\n");
+    return ok;
+  }
+  
   if (input_raster == NULL){
     fprintf(stderr, "Error. You must provide at least an input raster file.\n");
     fprintf(stderr, "Use r.lacunarity -h to get help on the input parameters.\n");
@@ -271,16 +522,37 @@ int main (int argc, const char *argv[]){
   
   GDALAllRegister();
   
+  if (approx == 0) approxMinBox = 0;
+  if (exec.maxMemory > 0 && !engineSet) exec.engine = LACUNARITY_ENGINE_AUTO;
+  
+  if (nThresholds > 0 && (spatial == 1 || approx == 1)){
+    fprintf(stderr, "Error. The binaryThresholds option is not compatible with the spatial and approx options.\n");
+    return 1;
+  }
+  
+  if (shardSet == 1 && spatial == 0){
+    fprintf(stderr, "Error. The shard option requires the spatial flag.\n");
+    return 1;
+  }
+  
   if (spatial == 1){
-    ok = spatial_lacunarity(input_raster, band, binary, binaryThreshold, f3d, gbox, mwin, output_file, format);
+    ok = spatial_lacunarity(input_raster, band, binary, binaryThreshold, f3d, gbox, mwin, approxMinBox,
+                            adaptiveTolerance, adaptiveStep, &exec, output_file, exact_file, format);
   }else{
     if (gbox_use_min_max == 0){
       gbox_min = gbox;
       gbox_max = gbox;
       gbox_step = 1;
     }
-    ok = lacunarity(input_raster, band, binary, binaryThreshold, f3d, gbox_min, gbox_max, gbox_step);
+    if (nThresholds > 0){
+      ok = lacunarity_thresholds(input_raster, band, thresholds, nThresholds, 
+                                 gbox_min, gbox_max, gbox_step);
+    }else{
+      ok = lacunarity(input_raster, band, binary, binaryThreshold, f3d, gbox_min, gbox_max, gbox_step, 
+                      approxMinBox, &exec);
+    }
   }
+  free(thresholds);
   
   fprintf(stdout, "r.lacunarity done.\n");
   return ok;
@@ -0,0 +1,404 @@
+#include "pipeline.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "lacunarity.h"
+
+
+
+/**
+ * The state shared by all threads of a pipeline run.
+ */
+typedef struct pipeline_state {
+  pipeline_params *params;
+  pipeline_queue readQueue;     // Tiles read, waiting for computation.
+  pipeline_queue writeQueue;    // Tiles computed, waiting to be written.
+  int activeWorkers;            // Compute threads still running.
+  int failed;                   // Set as soon as any stage fails.
+  int nTiles, nTilesWritten;
+  pthread_mutex_t lock;
+} pipeline_state;
+
+
+
+
+static int queue_init (pipeline_queue *queue, int capacity)
+{
+  queue->tiles = (pipeline_tile**)calloc(capacity, sizeof(pipeline_tile*));
+  if (queue->tiles == NULL) return 1;
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->count = 0;
+  queue->closed = 0;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->notEmpty, NULL);
+  pthread_cond_init(&queue->notFull, NULL);
+  return 0;
+}
+
+
+
+static void queue_destroy (pipeline_queue *queue)
+{
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->notEmpty);
+  pthread_cond_destroy(&queue->notFull);
+  free(queue->tiles);
+}
+
+
+
+/**
+ * Adds a tile to the queue, waiting as long as the queue is full.
+ */
+static void queue_push (pipeline_queue *queue, pipeline_tile *tile)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->capacity){
+    pthread_cond_wait(&queue->notFull, &queue->lock);
+  }
+  queue->tiles[(queue->head + queue->count) % queue->capacity] = tile;
+  queue->count++;
+  pthread_cond_signal(&queue->notEmpty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+
+
+/**
+ * Removes a tile from the queue, waiting as long as the queue is empty.
+ * Returns NULL once the queue is closed and empty.
+ */
+static pipeline_tile *queue_pop (pipeline_queue *queue)
+{
+  pipeline_tile *tile;
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !queue->closed){
+    pthread_cond_wait(&queue->notEmpty, &queue->lock);
+  }
+  tile = NULL;
+  if (queue->count > 0){
+    tile = queue->tiles[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->notFull);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return tile;
+}
+
+
+
+/**
+ * Signals that no more tiles will be added to the queue.
+ */
+static void queue_close (pipeline_queue *queue)
+{
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->notEmpty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+
+
+static void tile_free (pipeline_tile *tile)
+{
+  if (tile == NULL) return;
+  free(tile->data);
+  free(tile->mask);
+  free(tile->lacunarity);
+  free(tile->exact);
+  free(tile);
+}
+
+
+
+static void pipeline_fail (pipeline_state *state)
+{
+  pthread_mutex_lock(&state->lock);
+  state->failed = 1;
+  pthread_mutex_unlock(&state->lock);
+}
+
+
+
+static int pipeline_failed (pipeline_state *state)
+{
+  int failed;
+
+  pthread_mutex_lock(&state->lock);
+  failed = state->failed;
+  pthread_mutex_unlock(&state->lock);
+  return failed;
+}
+
+
+
+
+/**
+ * The reader stage. Reads the tiles row by row and hands them to the
+ * compute threads. As the read queue holds several tiles, the next tiles
+ * are read (and decompressed by GDAL) while the previous ones are computed.
+ * If the mask is read first and all pixels of a tile are masked, the
+ * data of the tile is not read at all.
+ */
+static void *pipeline_reader (void *arg)
+{
+  pipeline_state *state = (pipeline_state*)arg;
+  pipeline_params *p = state->params;
+  pipeline_tile *tile;
+  int x, y;
+  long i, nPixels, nValid;
+
+  for (y = 0; y < p->regionH; y += p->tileSize){
+    for (x = 0; x < p->regionW; x += p->tileSize){
+      if (pipeline_failed(state)) break;
+
+      tile = (pipeline_tile*)calloc(1, sizeof(pipeline_tile));
+      if (tile == NULL){
+        fprintf(stderr, "ERROR. Not enough memory for reading a tile.\n");
+        pipeline_fail(state);
+        break;
+      }
+      tile->x = x;
+      tile->y = y;
+      tile->w = MIN(p->tileSize, p->regionW - x);
+      tile->h = MIN(p->tileSize, p->regionH - y);
+      tile->dataX = tile->w + p->halo;
+      tile->dataY = tile->h + p->halo;
+      nPixels = (long)tile->dataX * tile->dataY;
+      
+      if (p->readMask != NULL){
+        tile->mask = (unsigned char*)malloc(nPixels);
+        if (tile->mask == NULL){
+          fprintf(stderr, "ERROR. Not enough memory for reading a tile.\n");
+          tile_free(tile);
+          pipeline_fail(state);
+          break;
+        }
+        if (p->readMask(p->ioArg, p->regionX + x, p->regionY + y,
+              tile->dataX, tile->dataY, tile->mask) != 0){
+          tile_free(tile);
+          pipeline_fail(state);
+          break;
+        }
+        nValid = 0;
+        for (i = 0; i < nPixels; i++){
+          if (tile->mask[i]) nValid++;
+        }
+        if (nValid == 0){
+          // Fully masked tile; it is passed on without data.
+          queue_push(&state->readQueue, tile);
+          continue;
+        }
+        if (nValid == nPixels){
+          free(tile->mask);
+          tile->mask = NULL;
+        }
+      }
+      
+      if (p->read == NULL){
+        queue_push(&state->readQueue, tile);
+        continue;
+      }
+      tile->data = (long*)malloc((size_t)nPixels * sizeof(long));
+      if (tile->data == NULL){
+        fprintf(stderr, "ERROR. Not enough memory for reading a tile.\n");
+        tile_free(tile);
+        pipeline_fail(state);
+        break;
+      }
+      if (p->read(p->ioArg, p->regionX + x, p->regionY + y,
+            tile->dataX, tile->dataY, tile->data) != 0){
+        tile_free(tile);
+        pipeline_fail(state);
+        break;
+      }
+      queue_push(&state->readQueue, tile);
+    }
+  }
+
+  queue_close(&state->readQueue);
+  return NULL;
+}
+
+
+
+
+/**
+ * The compute stage. Several compute threads run concurrently; the last one
+ * to finish closes the write queue.
+ */
+static void *pipeline_worker (void *arg)
+{
+  pipeline_state *state = (pipeline_state*)arg;
+  pipeline_params *p = state->params;
+  pipeline_tile *tile;
+  int last;
+
+  while ((tile = queue_pop(&state->readQueue)) != NULL){
+    if (pipeline_failed(state)){
+      tile_free(tile);
+      continue;
+    }
+    tile->lacunarity = (double*)calloc((size_t)tile->w * tile->h, sizeof(double));
+    if (p->writeExact != NULL){
+      tile->exact = (unsigned char*)calloc((size_t)tile->w * tile->h, 1);
+    }
+    if (tile->lacunarity == NULL || (p->writeExact != NULL && tile->exact == NULL)){
+      fprintf(stderr, "ERROR. Not enough memory for creating lacunarity raster.\n");
+      tile_free(tile);
+      pipeline_fail(state);
+      continue;
+    }
+    if (p->compute(tile, p->computeArg) != 0){
+      tile_free(tile);
+      pipeline_fail(state);
+      continue;
+    }
+    // The input data is not needed anymore; release it before queueing.
+    free(tile->data);
+    tile->data = NULL;
+    free(tile->mask);
+    tile->mask = NULL;
+    queue_push(&state->writeQueue, tile);
+  }
+
+  pthread_mutex_lock(&state->lock);
+  state->activeWorkers--;
+  last = (state->activeWorkers == 0);
+  pthread_mutex_unlock(&state->lock);
+  if (last) queue_close(&state->writeQueue);
+  return NULL;
+}
+
+
+
+
+/**
+ * The writer stage. Writes the finished tiles to the output and
+ * reports the progress.
+ */
+static void *pipeline_writer (void *arg)
+{
+  pipeline_state *state = (pipeline_state*)arg;
+  pipeline_params *p = state->params;
+  pipeline_tile *tile;
+  int pctDone, curPctDone;
+
+  pctDone = 0;
+  while ((tile = queue_pop(&state->writeQueue)) != NULL){
+    if (!pipeline_failed(state)){
+      if (p->write(p->ioArg, tile->x, tile->y,
+            tile->w, tile->h, tile->lacunarity) != 0 ||
+          (p->writeExact != NULL && p->writeExact(p->ioArg, tile->x, tile->y,
+            tile->w, tile->h, tile->exact) != 0)){
+        pipeline_fail(state);
+      }
+    }
+    tile_free(tile);
+
+    state->nTilesWritten++;
+    curPctDone = (10 * state->nTilesWritten) / state->nTiles;
+    if (p->verbose && curPctDone > pctDone && curPctDone < 10){
+      pctDone = curPctDone;
+      fprintf(stdout, "%i%% done.\n", pctDone*10);
+    }
+  }
+  return NULL;
+}
+
+
+
+
+int pipeline_run (pipeline_params *params)
+{
+  pipeline_state state;
+  pthread_t reader, writer;
+  pthread_t *workers;
+  pipeline_tile *tile;
+  int i, nWorkers;
+  int readerStarted, writerStarted;
+
+
+  state.params = params;
+  state.failed = 0;
+  state.nTilesWritten = 0;
+  state.nTiles = ((params->regionW + params->tileSize - 1) / params->tileSize) *
+                 ((params->regionH + params->tileSize - 1) / params->tileSize);
+
+  workers = (pthread_t*)calloc(params->nThreads, sizeof(pthread_t));
+  if (workers == NULL ||
+      queue_init(&state.readQueue, params->queueDepth) != 0){
+    fprintf(stderr, "ERROR. Not enough memory for the pipeline.\n");
+    free(workers);
+    return 1;
+  }
+  if (queue_init(&state.writeQueue, params->queueDepth) != 0){
+    fprintf(stderr, "ERROR. Not enough memory for the pipeline.\n");
+    queue_destroy(&state.readQueue);
+    free(workers);
+    return 1;
+  }
+  pthread_mutex_init(&state.lock, NULL);
+
+
+  // Start the stages. The worker count is set before any worker runs, as
+  // the last worker to finish is the one closing the write queue.
+  state.activeWorkers = params->nThreads;
+  readerStarted = (pthread_create(&reader, NULL, pipeline_reader, &state) == 0);
+  if (!readerStarted){
+    // Without tiles, the workers finish right away.
+    fprintf(stderr, "ERROR. Unable to start the reader thread.\n");
+    pipeline_fail(&state);
+    queue_close(&state.readQueue);
+  }
+  nWorkers = 0;
+  for (i = 0; i < params->nThreads; i++){
+    if (pthread_create(&workers[i], NULL, pipeline_worker, &state) != 0) break;
+    nWorkers++;
+  }
+  if (nWorkers < params->nThreads){
+    // Account for the threads that could not be started.
+    pthread_mutex_lock(&state.lock);
+    state.activeWorkers -= (params->nThreads - nWorkers);
+    pthread_mutex_unlock(&state.lock);
+    if (nWorkers == 0){
+      fprintf(stderr, "ERROR. Unable to start the compute threads.\n");
+      pipeline_fail(&state);
+      queue_close(&state.writeQueue);
+      // Drain the read queue so that the reader can finish.
+      while ((tile = queue_pop(&state.readQueue)) != NULL) tile_free(tile);
+    }
+  }
+  writerStarted = (pthread_create(&writer, NULL, pipeline_writer, &state) == 0);
+  if (!writerStarted){
+    // Drain the write queue in place of the writer, so that the workers
+    // can finish.
+    fprintf(stderr, "ERROR. Unable to start the writer thread.\n");
+    pipeline_fail(&state);
+    while ((tile = queue_pop(&state.writeQueue)) != NULL) tile_free(tile);
+  }
+
+
+  // Wait for the stages that were started to finish.
+  if (readerStarted) pthread_join(reader, NULL);
+  for (i = 0; i < nWorkers; i++){
+    pthread_join(workers[i], NULL);
+  }
+  if (writerStarted) pthread_join(writer, NULL);
+
+  if (params->verbose && !state.failed) fprintf(stdout, "100%% done.\n");
+
+  pthread_mutex_destroy(&state.lock);
+  queue_destroy(&state.readQueue);
+  queue_destroy(&state.writeQueue);
+  free(workers);
+
+  return state.failed;
+}
+
+
@@ -0,0 +1,101 @@
+#include <pthread.h>
+
+
+
+/**
+ * A tile travelling through the pipeline. It holds the input data of the
+ * tile, including a halo of mwin-1 pixels on the right and bottom side,
+ * and the computed lacunarity values.
+ */
+typedef struct pipeline_tile {
+  int x, y;                     // Offset of the tile in the output region.
+  int w, h;                     // Size of the tile in output pixels.
+  int dataX, dataY;             // Size of the input data (tile and halo).
+  long *data;                   // The input data (dataX * dataY values), or
+                                // NULL if all pixels are masked.
+  unsigned char *mask;          // The validity mask of the input data, or
+                                // NULL if all pixels are valid.
+  double *lacunarity;           // The lacunarity values (w * h values).
+  unsigned char *exact;         // Flags of the exactly computed values (w * h
+                                // values), or NULL if they are not written.
+} pipeline_tile;
+
+
+
+/**
+ * A bounded queue of tiles shared between the pipeline stages.
+ */
+typedef struct pipeline_queue {
+  pipeline_tile **tiles;
+  int capacity;
+  int head, count;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty, notFull;
+} pipeline_queue;
+
+
+
+/**
+ * Computes the lacunarity values of a tile from its input data.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+typedef int (*pipeline_compute_fn) (pipeline_tile *tile, void *arg);
+
+
+
+/**
+ * Reads a window of the input data (or of its validity mask) into an array
+ * of xSize * ySize values. Writes a window of lacunarity values.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+typedef int (*pipeline_read_fn) (void *arg, int xOff, int yOff, int xSize, int ySize, long *data);
+typedef int (*pipeline_read_mask_fn) (void *arg, int xOff, int yOff, int xSize, int ySize, 
+               unsigned char *mask);
+typedef int (*pipeline_write_fn) (void *arg, int xOff, int yOff, int xSize, int ySize, 
+               double *values);
+typedef int (*pipeline_write_flags_fn) (void *arg, int xOff, int yOff, int xSize, int ySize, 
+               unsigned char *flags);
+
+
+
+/**
+ * The parameters of a pipelined computation. A reader thread reads the
+ * tiles of the output region (plus halo) from the input, nThreads
+ * compute threads run the compute function on them, and a writer thread
+ * writes the finished tiles to the output. The input and output are
+ * accessed through callbacks, e.g. on GDAL bands or on memory buffers.
+ * At most queueDepth tiles wait in each of the two queues, hence the memory
+ * used is bounded by (2 * queueDepth + nThreads + 2) tiles.
+ */
+typedef struct pipeline_params {
+  pipeline_read_fn read;        // Reads the input data (reader thread only),
+                                // or NULL if the compute function accesses
+                                // the input directly.
+  pipeline_read_mask_fn readMask; // Reads the validity mask, or NULL if all
+                                // pixels are valid (reader thread only).
+  pipeline_write_fn write;      // Writes the output (writer thread only).
+  pipeline_write_flags_fn writeExact; // Writes the flags of the exactly computed
+                                // values, or NULL (writer thread only).
+  void *ioArg;                  // Argument given to the callbacks.
+  int regionX, regionY;         // Offset of the output region in the input raster.
+  int regionW, regionH;         // Size of the output region.
+  int halo;                     // Additional input pixels needed (mwin-1).
+  int tileSize;                 // Size of the tiles in output pixels.
+  int nThreads;                 // Number of compute threads.
+  int queueDepth;               // Capacity of each queue.
+  int verbose;                  // Print the progress to stdout.
+  pipeline_compute_fn compute;
+  void *computeArg;
+} pipeline_params;
+
+
+
+/**
+ * Runs the read, compute and write stages concurrently until all tiles
+ * of the output region are written.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+int pipeline_run (pipeline_params *params);
+
+
@@ -0,0 +1,329 @@
+#include "planner.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include "pyramid.h"
+#include "sparse.h"
+
+
+
+/**
+ * Formats a memory size in MB, or in KB for small sizes.
+ */
+static void format_size (double bytes, char *text)
+{
+  if (bytes < 1024.0 * 1024.0){
+    sprintf(text, "%.1f KB", bytes / 1024.0);
+  }else{
+    sprintf(text, "%.1f MB", bytes / (1024.0 * 1024.0));
+  }
+}
+
+
+
+/**
+ * Returns the number of levels of a gliding box of size gbox.
+ */
+static double plan_levels (plan_request *r, int gbox)
+{
+  double maxValue;
+
+  maxValue = r->binary ? 1 : MAX(r->maxValue, 1);
+  return r->f3d ? maxValue : ceil(maxValue / gbox);
+}
+
+
+
+/**
+ * Returns the number of gliding box positions in a window.
+ */
+static double plan_boxes (int gbox, double winW, double winH)
+{
+  if (winW < gbox || winH < gbox) return 0;
+  return (winW - gbox + 1) * (winH - gbox + 1);
+}
+
+
+
+/**
+ * Returns whether a gliding box is approximated on a pyramid level.
+ */
+static int plan_approximated (plan_request *r, int gbox, int winSize)
+{
+  return r->binary && r->approxMinBox > 0 && gbox >= r->approxMinBox &&
+         pyramid_level_for_box(gbox, winSize) > 0;
+}
+
+
+
+/**
+ * Returns the largest density of foreground and invalid pixels at which
+ * the sparse representation is used for a window (see sparse_is_faster),
+ * or 0 if it is never used. The sparse cost grows with the density.
+ */
+static double plan_sparse_density (int gbox, int winW, int winH)
+{
+  double low, high, density;
+  int i;
+
+  if (!sparse_is_faster(0.0, gbox, winW, winH)) return 0;
+  if (sparse_is_faster(1.0, gbox, winW, winH)) return 1;
+  low = 0;
+  high = 1;
+  for (i = 0; i < 20; i++){
+    density = (low + high) / 2;
+    if (sparse_is_faster(density, gbox, winW, winH)){
+      low = density;
+    }else{
+      high = density;
+    }
+  }
+  return high;
+}
+
+
+
+/**
+ * Memory of the sparse representation of dataX x dataY pixels: the row
+ * starts, the columns of the foreground and invalid pixels, and the events
+ * of a row of gliding boxes, which may see whole rows of the data.
+ */
+static double sparse_memory (plan_request *r, int gbox, double density, double dataX, double dataY)
+{
+  return (dataY + 1) * 8 * (r->hasMask ? 2 : 1) + density * dataX * dataY * 4 + 2 * dataX * gbox * 12;
+}
+
+
+
+/**
+ * Memory and cost of the histogram engine for one window: the intensity
+ * sum table with its narrowest counter type, and the histogram. The cost
+ * counts the pixel visits of all boxes and levels.
+ */
+static double histogram_memory (plan_request *r, int gbox, double winW, double winH)
+{
+  double nLevels, bound, counterSize;
+
+  nLevels = plan_levels(r, gbox);
+  bound = (double)gbox * gbox * MIN(r->binary ? 1 : MAX(r->maxValue, 1), gbox);
+  counterSize = (bound <= 0xFF) ? 1 : ((bound <= 0xFFFF) ? 2 : ((bound <= 0xFFFFFFFFUL) ? 4 : 8));
+  return plan_boxes(gbox, winW, winH) * nLevels * counterSize + nLevels * 8 + (bound + 1) * 8;
+}
+
+static double histogram_cost (plan_request *r, int gbox, double winW, double winH)
+{
+  return plan_boxes(gbox, winW, winH) * gbox * gbox * (plan_levels(r, gbox) + 1) + winW * winH;
+}
+
+
+
+/**
+ * Memory and cost of the integral engine for an array of dataX x dataY
+ * pixels and nOut windows: the level integral image, the integral images
+ * of the box masses and the per-window moments. The cost counts the
+ * integral image updates and lookups of all levels.
+ */
+static double integral_memory (int gbox, double dataX, double dataY, double nOut)
+{
+  return (dataX + 1) * (dataY + 1) * 8 + (dataX - gbox + 2) * (dataY - gbox + 2) * 20 + nOut * 28;
+}
+
+static double integral_cost (plan_request *r, int gbox, double dataX, double dataY, double nOut)
+{
+  double nBoxes;
+
+  nBoxes = plan_boxes(gbox, dataX, dataY);
+  return plan_levels(r, gbox) * (2 * dataX * dataY + 3 * nBoxes + 3 * nOut) + 2 * nBoxes;
+}
+
+
+
+/**
+ * Estimates the global lacunarity, which holds the whole raster in memory.
+ */
+static void plan_global (plan_request *r, lacunarity_engine engine, double *memory, double *cost)
+{
+  double N, X, Y, base, work, pyramid, density, d;
+  int g, gSparse;
+
+  X = r->rasterX;
+  Y = r->rasterY;
+  N = X * Y;
+  base = N * 8;
+  if (r->hasMask) base += N + (X + 1) * (Y + 1) * 4;
+
+  // The pyramid levels, their integral images and the exact values of the
+  // calibration at full resolution.
+  pyramid = N * 8 * (r->hasMask ? 2 : 1) * (1.0 / 3.0 + 1.0) + (r->hasMask ? N * 8 : 0);
+
+  // The sparse representation of a binary image is kept for all box sizes
+  // if it is used for any of them.
+  density = 0;
+  gSparse = 0;
+  if (r->binary && engine != LACUNARITY_ENGINE_INTEGRAL){
+    for (g = r->gbox_min; g <= r->gbox_max; g += MAX(r->gbox_step, 1)){
+      if (plan_approximated(r, g, MIN(r->rasterX, r->rasterY))) continue;
+      d = plan_sparse_density(g, r->rasterX, r->rasterY);
+      if (d > 0){
+        density = MAX(density, d);
+        gSparse = g;
+      }
+    }
+  }
+  if (density > 0) base += sparse_memory(r, gSparse, density, X, Y);
+
+  work = 0;
+  *cost = 0;
+  for (g = r->gbox_min; g <= r->gbox_max; g += MAX(r->gbox_step, 1)){
+    if (plan_approximated(r, g, MIN(r->rasterX, r->rasterY))){
+      work = MAX(work, pyramid);
+      *cost += N;
+    }else if (engine == LACUNARITY_ENGINE_INTEGRAL){
+      work = MAX(work, integral_memory(g, X, Y, 1));
+      *cost += integral_cost(r, g, X, Y, 1);
+    }else{
+      work = MAX(work, histogram_memory(r, g, X, Y));
+      *cost += histogram_cost(r, g, X, Y);
+    }
+  }
+  *memory = base + work;
+}
+
+
+
+/**
+ * Estimates the spatial lacunarity, computed in tiles by the pipeline.
+ */
+static void plan_spatial (plan_request *r, lacunarity_engine engine,
+            int nThreads, int tileSize, int queueDepth, double *memory, double *cost)
+{
+  double d, tileData, tileOut, work, nTiles, tileCost, density;
+  int g;
+
+  g = r->gbox_min;
+  d = tileSize + r->mwin - 1;
+  tileData = d * d * (r->hasMask ? 9 : 8);
+  tileOut = (double)tileSize * tileSize * (r->exactMask ? 9 : 8);
+
+  // Working memory and cost per compute thread and tile.
+  work = r->hasMask ? (d + 1) * (d + 1) * 4 : 0;
+  if (plan_approximated(r, g, r->mwin)){
+    work += d * d * 8 * (r->hasMask ? 2 : 1);
+    tileCost = d * d;
+  }else if (engine == LACUNARITY_ENGINE_INTEGRAL){
+    work += integral_memory(g, d, d, (double)tileSize * tileSize);
+    tileCost = integral_cost(r, g, d, d, (double)tileSize * tileSize);
+  }else{
+    work += histogram_memory(r, g, r->mwin, r->mwin);
+    tileCost = (double)tileSize * tileSize * histogram_cost(r, g, r->mwin, r->mwin);
+    density = r->binary ? plan_sparse_density(g, r->mwin, r->mwin) : 0;
+    if (density > 0) work += sparse_memory(r, g, density, d, d);
+    // The adaptive grid flags its exact windows in the tile if the exact
+    // flags are written, and in a buffer of the thread otherwise.
+    if (r->adaptive && !r->exactMask) work += (double)tileSize * tileSize;
+  }
+
+  // See pipeline_params for the number of tiles in flight.
+  *memory = (2.0 * queueDepth + nThreads + 2) * (tileData + tileOut) + nThreads * work;
+  nTiles = ceil((double)r->rasterX / tileSize) * ceil((double)r->rasterY / tileSize);
+  *cost = (double)r->rasterX * r->rasterY * (tileCost / ((double)tileSize * tileSize)) / 
+          MIN(nThreads, nTiles);
+}
+
+
+
+
+int plan_execution (plan_request *request, lacunarity_exec *exec, double *memory)
+{
+  lacunarity_engine engines[2];
+  int nEngines, e, t, s, q;
+  int maxTile;
+  double mem, cost;
+  double bestCost, minMemory;
+  lacunarity_exec best;
+  char budget[32], needed[32];
+
+  // The engines to choose from.
+  nEngines = 0;
+  if (exec->engine == LACUNARITY_ENGINE_AUTO){
+    engines[nEngines++] = LACUNARITY_ENGINE_HISTOGRAM;
+    engines[nEngines++] = LACUNARITY_ENGINE_INTEGRAL;
+  }else{
+    engines[nEngines++] = exec->engine;
+  }
+
+  // Tiles larger than the output region are not useful.
+  maxTile = MAX(MIN(exec->tileSize, MAX(request->rasterX, request->rasterY)), 1);
+
+  // Walk through the plans from the largest to the smallest; a plan is
+  // only taken over a previous one if it is really faster.
+  bestCost = -1;
+  minMemory = -1;
+  best = *exec;
+  for (e = 0; e < nEngines; e++){
+    if (!request->spatial){
+      plan_global(request, engines[e], &mem, &cost);
+      if (minMemory < 0 || mem < minMemory) minMemory = mem;
+      if (mem <= exec->maxMemory && (bestCost < 0 || cost < 0.99 * bestCost)){
+        bestCost = cost;
+        best.engine = engines[e];
+        *memory = mem;
+      }
+      continue;
+    }
+    for (t = MAX(exec->nThreads, 1); t >= 1; t--){
+      // Tile sizes are halved down to 16 pixels.
+      s = maxTile;
+      while (1){
+        for (q = MAX(exec->queueDepth, 1); q >= 1; q--){
+          plan_spatial(request, engines[e], t, s, q, &mem, &cost);
+          if (minMemory < 0 || mem < minMemory) minMemory = mem;
+          if (mem <= exec->maxMemory && (bestCost < 0 || cost < 0.99 * bestCost)){
+            bestCost = cost;
+            best.engine = engines[e];
+            best.nThreads = t;
+            best.tileSize = s;
+            best.queueDepth = q;
+            *memory = mem;
+          }
+        }
+        if (s <= 16) break;
+        s = MAX(s / 2, 16);
+      }
+    }
+  }
+
+  if (bestCost < 0){
+    *memory = minMemory;
+    format_size((double)exec->maxMemory, budget);
+    format_size(minMemory, needed);
+    fprintf(stderr, "ERROR. No execution plan fits into %s; the smallest one needs %s.\n", 
+        budget, needed);
+    return 1;
+  }
+  *exec = best;
+  return 0;
+}
+
+
+
+
+void plan_print (plan_request *request, lacunarity_exec *exec, double memory)
+{
+  const char *engine;
+  char budget[32], needed[32];
+
+  engine = (exec->engine == LACUNARITY_ENGINE_INTEGRAL) ? "integral" : "histogram";
+  if (request->spatial){
+    fprintf(stdout, "Execution plan: %s engine, %i threads, tiles of %ix%i pixels, queue depth %i.\n",
+        engine, exec->nThreads, exec->tileSize, exec->tileSize, exec->queueDepth);
+  }else{
+    fprintf(stdout, "Execution plan: %s engine, whole raster in memory.\n", engine);
+  }
+  format_size(memory, needed);
+  format_size((double)exec->maxMemory, budget);
+  fprintf(stdout, "Estimated memory: %s of %s.\n", needed, budget);
+}
+
+
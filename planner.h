@@ -0,0 +1,59 @@
+/**
+ * Execution planner. Estimates the memory footprint and the relative
+ * running time of the possible ways to execute a run (engine, number of
+ * threads, tile size, queue depth), and chooses the fastest one fitting
+ * into a memory budget.
+ *
+ * The estimates cover the arrays allocated by this program: the input
+ * data and masks, the tiles in flight in the pipeline with their exact
+ * window flags, and the working memory of each compute thread, including
+ * the flags of the adaptive grid and the sparse lists of binary images.
+ * The sparse lists depend on the data, so they are estimated for the
+ * largest density they are used at. The estimates do not include the GDAL
+ * block cache.
+ */
+
+#include "lacunarity.h"
+
+
+
+/**
+ * The properties of a run the plan is chosen for.
+ */
+typedef struct plan_request {
+  int spatial;                  // Spatial (1) or global (0) lacunarity.
+  int rasterX, rasterY;         // The size of the input raster, or of the
+                                // output region for the spatial lacunarity.
+  int hasMask;                  // Whether some pixels may be invalid.
+  long maxValue;                // The (estimated) maximum pixel value.
+  int binary, f3d;
+  int gbox_min, gbox_max, gbox_step;
+  int mwin;                     // The moving window (spatial only).
+  int approxMinBox;
+  int adaptive;                 // Adaptive refinement (spatial only).
+  int exactMask;                // Whether the exact window flags are
+                                // written (spatial only).
+} plan_request;
+
+
+
+/**
+ * Chooses the fastest execution options for which the estimated memory
+ * fits into exec->maxMemory. The engine is only chosen if exec->engine is
+ * LACUNARITY_ENGINE_AUTO; the number of threads, the tile size and the
+ * queue depth are at most the ones given in exec. exec is updated with
+ * the chosen options, and the estimated memory is returned in memory.
+ * Returns 0 if a plan fits. Otherwise, an error is printed to stderr, memory
+ * holds the estimate of the smallest plan, and 1 is returned.
+ */
+int plan_execution (plan_request *request, lacunarity_exec *exec, double *memory);
+
+
+
+/**
+ * Prints the chosen plan and its estimated memory to stdout.
+ */
+void plan_print (plan_request *request, lacunarity_exec *exec, double memory);
+
+
+
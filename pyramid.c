@@ -0,0 +1,171 @@
+#include "pyramid.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+
+
+long *pyramid_level (long *data, int rasterX, int rasterY, int level,
+            int *levelX, int *levelY)
+{
+  long *src, *dst;
+  int srcX, srcY, dstX, dstY;
+  int i, j, l;
+
+  src = data;
+  srcX = rasterX;
+  srcY = rasterY;
+  dst = NULL;
+
+  // Halve the resolution level by level, summing 2x2 cells.
+  for (l = 0; l < level; l++){
+    dstX = srcX / 2;
+    dstY = srcY / 2;
+    if (dstX == 0 || dstY == 0){
+      fprintf(stderr, "ERROR. The raster is too small for pyramid level %i.\n", level);
+      if (src != data) free(src);
+      return NULL;
+    }
+    dst = (long*)malloc((size_t)dstX * dstY * sizeof(long));
+    if (dst == NULL){
+      fprintf(stderr, "ERROR. Not enough memory for pyramid level %i.\n", l+1);
+      if (src != data) free(src);
+      return NULL;
+    }
+    for (j = 0; j < dstY; j++){
+      for (i = 0; i < dstX; i++){
+        dst[(long)j*dstX + i] = src[(2L*j)*srcX + 2*i]   + src[(2L*j)*srcX + 2*i+1] +
+                                src[(2L*j+1)*srcX + 2*i] + src[(2L*j+1)*srcX + 2*i+1];
+      }
+    }
+    if (src != data) free(src);
+    src = dst;
+    srcX = dstX;
+    srcY = dstY;
+  }
+
+  *levelX = srcX;
+  *levelY = srcY;
+  return src;
+}
+
+
+
+
+/**
+ * Computes the integral image of a window of a data array. The integral
+ * image has one additional row and column of zeros at the top and left.
+ */
+static void integral_image (long *data, int rasterX, 
+            int mwinX, int mwinY, int mwinW, int mwinH, long long *integral)
+{
+  int i, j;
+  long long rowSum;
+
+  for (j = 0; j < mwinH; j++){
+    rowSum = 0;
+    for (i = 0; i < mwinW; i++){
+      rowSum += data[(mwinY+j)*(long)rasterX + mwinX+i];
+      integral[(long)(j+1)*(mwinW+1) + i+1] = integral[(long)j*(mwinW+1) + i+1] + rowSum;
+    }
+  }
+}
+
+
+
+
+int pyramid_level_for_box (int gbox, int mwin)
+{
+  int level;
+
+  level = 0;
+  while ((gbox >> (level+1)) >= PYRAMID_MIN_BOX_CELLS &&
+         (mwin >> (level+1)) >= (int)ceil((double)gbox / (1 << (level+1)))){
+    level++;
+  }
+  return level;
+}
+
+
+
+
+double pyramid_lacunarity_in_window (long *data, long *invalid, int rasterX, int rasterY,
+            double boxCells,
+            int mwinX, int mwinY, int mwinW, int mwinH)
+{
+  long long *integral;          // Integral image of the window.
+  long long *invalidIntegral;   // Integral image of the invalid pixel counts.
+  int boxFull;                  // Number of fully covered cells per direction.
+  double frac;                  // Covered fraction of the partly covered cell.
+  int boxSpan;                  // Number of cells touched per direction.
+  int nStepsX, nStepsY;
+  int i, j;
+  long long full, col, row, corner;
+  double mass, sum, sum2, n;
+  long nBoxes;
+
+  boxFull = (int)floor(boxCells);
+  frac = boxCells - boxFull;
+  boxSpan = boxFull + (frac > 0 ? 1 : 0);
+  nStepsX = mwinW - boxSpan + 1;
+  nStepsY = mwinH - boxSpan + 1;
+  if (boxFull < 1 || nStepsX < 1 || nStepsY < 1) return 0.0;
+
+  // The integral image has one additional row and column of zeros.
+  integral = (long long*)calloc((size_t)(mwinW+1) * (mwinH+1), sizeof(long long));
+  invalidIntegral = NULL;
+  if (invalid != NULL){
+    invalidIntegral = (long long*)calloc((size_t)(mwinW+1) * (mwinH+1), sizeof(long long));
+  }
+  if (integral == NULL || (invalid != NULL && invalidIntegral == NULL)){
+    fprintf(stderr, "ERROR. Not enough memory for the integral image.\n");
+    free(integral);
+    free(invalidIntegral);
+    return LACUNARITY_ERROR;
+  }
+  integral_image(data, rasterX, mwinX, mwinY, mwinW, mwinH, integral);
+  if (invalid != NULL){
+    integral_image(invalid, rasterX, mwinX, mwinY, mwinW, mwinH, invalidIntegral);
+  }
+
+#define RECT_SUM(ii, x0, y0, x1, y1) \
+  (ii[(long)(y1)*(mwinW+1) + (x1)] - ii[(long)(y0)*(mwinW+1) + (x1)] - \
+   ii[(long)(y1)*(mwinW+1) + (x0)] + ii[(long)(y0)*(mwinW+1) + (x0)])
+
+  // Sum up the first and second moments of the box masses. Boxes touching
+  // a cell with invalid pixels are left out.
+  sum = 0;
+  sum2 = 0;
+  nBoxes = 0;
+  for (j = 0; j < nStepsY; j++){
+    for (i = 0; i < nStepsX; i++){
+      if (invalidIntegral != NULL && 
+          RECT_SUM(invalidIntegral, i, j, i+boxSpan, j+boxSpan) > 0) continue;
+      full = RECT_SUM(integral, i, j, i+boxFull, j+boxFull);
+      mass = (double)full;
+      if (frac > 0){
+        col = RECT_SUM(integral, i+boxFull, j, i+boxFull+1, j+boxFull);
+        row = RECT_SUM(integral, i, j+boxFull, i+boxFull, j+boxFull+1);
+        corner = RECT_SUM(integral, i+boxFull, j+boxFull, i+boxFull+1, j+boxFull+1);
+        mass += frac * (col + row) + frac * frac * corner;
+      }
+      sum += mass;
+      sum2 += mass * mass;
+      nBoxes++;
+    }
+  }
+
+#undef RECT_SUM
+
+  free(integral);
+  free(invalidIntegral);
+
+  // As for the exact computation, an empty window has a lacunarity of 0.
+  if (nBoxes == 0) return LACUNARITY_NODATA;
+  if (sum <= 0) return 0.0;
+  n = (double)nBoxes;
+  return (sum2 / n) / ((sum / n) * (sum / n));
+}
+
+
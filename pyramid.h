@@ -0,0 +1,60 @@
+/**
+ * Sum-preserving image pyramid used for approximating the lacunarity of
+ * binary images at large gliding box sizes.
+ *
+ * Each pyramid level halves the resolution; a cell of level l holds the sum
+ * of the 2^l x 2^l pixels it covers. The mass of a gliding box of size
+ * gbox aligned on the cells of level l is therefore exactly the sum over
+ * gbox / 2^l cells in each direction. Only the box positions aligned on
+ * the cells are evaluated, which gives the approximation.
+ */
+
+#include "lacunarity.h"
+
+
+
+/**
+ * The smallest gliding box size, in cells of a pyramid level, used for
+ * approximating the lacunarity. Smaller boxes give coarser estimates.
+ */
+#define PYRAMID_MIN_BOX_CELLS 16
+
+
+
+/**
+ * Builds pyramid level l (l >= 1) of a data array: every cell holds the
+ * sum of the 2^l x 2^l input pixels it covers. Incomplete cells at the
+ * right and bottom border are dropped. The size of the level is returned
+ * in levelX and levelY.
+ * Returns the new array, or NULL in case of an error.
+ */
+long *pyramid_level (long *data, int rasterX, int rasterY, int level,
+            int *levelX, int *levelY);
+
+
+
+/**
+ * Returns the pyramid level on which a gliding box of size gbox is
+ * evaluated in a moving window of size mwin: the coarsest level keeping
+ * at least PYRAMID_MIN_BOX_CELLS cells per box, on which the box still fits
+ * into the window. Returns 0 if the box should be evaluated exactly.
+ */
+int pyramid_level_for_box (int gbox, int mwin);
+
+
+
+/**
+ * Computes the lacunarity of the box masses inside a given window of a
+ * pyramid level. The box size boxCells is given in cells and may be
+ * fractional; a partly covered cell contributes with the covered fraction
+ * of its sum. On level 0 with an integer box size, the result is the exact
+ * lacunarity of a binary image.
+ * If invalid is not NULL, it holds the number of invalid (nodata) pixels
+ * of each cell, and boxes touching invalid pixels are left out.
+ * Returns LACUNARITY_ERROR in case of an error.
+ */
+double pyramid_lacunarity_in_window (long *data, long *invalid, int rasterX, int rasterY,
+            double boxCells,
+            int mwinX, int mwinY, int mwinW, int mwinH);
+
+
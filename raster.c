@@ -5,6 +5,31 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "gdal_utils.h"
+#include "cpl_string.h"
+#include "cpl_conv.h"
+
+
+
+/**
+ * GDAL has no native long data type. We read the values as 32 bit integers
+ * into the beginning of the long array and widen them in place, starting
+ * from the end so that no value is overwritten before it is converted.
+ */
+static void widen_int32_to_long (long *data, long nValues)
+{
+  int *intData;
+  
+  if (sizeof(long) == sizeof(int)) return;
+  intData = (int*)data;
+  while (nValues > 0){
+    nValues--;
+    data[nValues] = intData[nValues];
+  }
+}
 
 
 
@@ -77,6 +102,7 @@ int raster_band_read_long (char *raster, int band, long **data, int *rasterX, in
     return 1;
   }
   GDALRasterIO(iband, GF_Read, 0, 0, *rasterX, *rasterY, *data, *rasterX, *rasterY, GDT_Int32, 0, 0);
+  widen_int32_to_long(*data, (long)*rasterX * *rasterY);
   
   GDALClose(idataset);
   
@@ -86,6 +112,184 @@ int raster_band_read_long (char *raster, int band, long **data, int *rasterX, in
 
 
 
+int raster_band_read_long_window (char *raster, int band, 
+               int xOff, int yOff, int xSize, int ySize, long **data)
+{
+  GDALDatasetH idataset;
+  GDALRasterBandH iband;        // The input raster band.
+  int ok;
+  
+  
+  // Open the input raster file.
+  idataset = GDALOpen(raster, GA_ReadOnly);
+  if (idataset == NULL)
+  {
+    fprintf(stderr, "Error. Unable to open raster '%s'\n", raster);
+    return 1;
+  }
+  
+  // Get the input raster band.
+  iband = GDALGetRasterBand(idataset, band);
+  if (iband == NULL)
+  {
+    GDALClose(idataset);
+    fprintf(stderr, "Error. Unable to read band %i of raster '%s'\n", band, raster);
+    return 1;
+  }
+  
+  // Fetch the content of the window.
+  *data = (long*) malloc((size_t)xSize * ySize * sizeof(long));
+  if (*data == NULL)
+  {
+    GDALClose(idataset);
+    fprintf(stderr, "Error. Not enough memory to read raster '%s'.\n", raster);
+    return 1;
+  }
+  ok = raster_band_read_long_block(iband, xOff, yOff, xSize, ySize, *data);
+  GDALClose(idataset);
+  if (ok != 0)
+  {
+    free(*data);
+    *data = NULL;
+    fprintf(stderr, "Error. Unable to read raster '%s'.\n", raster);
+    return 1;
+  }
+  
+  return 0;
+}
+
+
+
+
+int raster_band_read_long_block (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, long *data)
+{
+  CPLErr err;
+  
+  err = GDALRasterIO(band, GF_Read, xOff, yOff, xSize, ySize, data, xSize, ySize, GDT_Int32, 0, 0);
+  if (err != CE_None)
+  {
+    fprintf(stderr, "Error. Unable to read window %i/%i (%ix%i).\n", xOff, yOff, xSize, ySize);
+    return 1;
+  }
+  widen_int32_to_long(data, (long)xSize * ySize);
+  
+  return 0;
+}
+
+
+
+
+
+
+
+int raster_band_has_mask (GDALRasterBandH band)
+{
+  return (GDALGetMaskFlags(band) & GMF_ALL_VALID) ? 0 : 1;
+}
+
+
+
+long raster_band_max_value (GDALRasterBandH band)
+{
+  double maxValue;
+  double minMax[2];
+  int ok;
+  
+  maxValue = GDALGetRasterMaximum(band, &ok);
+  if (!ok){
+    // Not given by the dataset; estimate it from a subsample (overviews).
+    GDALComputeRasterMinMax(band, TRUE, minMax);
+    maxValue = minMax[1];
+  }
+  if (maxValue <= 0) return 0;
+  if (maxValue >= 2147483647.0) return 2147483647L;
+  return (long)ceil(maxValue);
+}
+
+
+
+
+int raster_band_read_mask_block (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, unsigned char *mask)
+{
+  GDALRasterBandH maskBand;
+  CPLErr err;
+  
+  // The mask band covers nodata values, alpha bands and mask files.
+  maskBand = GDALGetMaskBand(band);
+  if (maskBand == NULL)
+  {
+    fprintf(stderr, "Error. Unable to get the mask band.\n");
+    return 1;
+  }
+  err = GDALRasterIO(maskBand, GF_Read, xOff, yOff, xSize, ySize, mask, xSize, ySize, GDT_Byte, 0, 0);
+  if (err != CE_None)
+  {
+    fprintf(stderr, "Error. Unable to read mask window %i/%i (%ix%i).\n", xOff, yOff, xSize, ySize);
+    return 1;
+  }
+  
+  return 0;
+}
+
+
+
+
+int raster_band_read_mask (char *raster, int band, unsigned char **mask)
+{
+  GDALDatasetH idataset;
+  GDALRasterBandH iband;
+  int rasterX, rasterY;
+  int ok;
+  
+  
+  *mask = NULL;
+  idataset = GDALOpen(raster, GA_ReadOnly);
+  if (idataset == NULL)
+  {
+    fprintf(stderr, "Error. Unable to open raster '%s'\n", raster);
+    return 1;
+  }
+  iband = GDALGetRasterBand(idataset, band);
+  if (iband == NULL)
+  {
+    GDALClose(idataset);
+    fprintf(stderr, "Error. Unable to read band %i of raster '%s'\n", band, raster);
+    return 1;
+  }
+  
+  // Nothing to read if all pixels are valid.
+  if (!raster_band_has_mask(iband))
+  {
+    GDALClose(idataset);
+    return 0;
+  }
+  
+  rasterX = GDALGetRasterXSize(idataset);
+  rasterY = GDALGetRasterYSize(idataset);
+  *mask = (unsigned char*) malloc((size_t)rasterX * rasterY);
+  if (*mask == NULL)
+  {
+    GDALClose(idataset);
+    fprintf(stderr, "Error. Not enough memory to read the mask of raster '%s'.\n", raster);
+    return 1;
+  }
+  ok = raster_band_read_mask_block(iband, 0, 0, rasterX, rasterY, *mask);
+  GDALClose(idataset);
+  if (ok != 0)
+  {
+    free(*mask);
+    *mask = NULL;
+    return 1;
+  }
+  
+  return 0;
+}
+
+
+
+
 
 
 
@@ -170,6 +374,314 @@ int raster_band_write_double(char *raster, char *format, int band, double *adfGe
 
 
 
+int raster_merge (char **tiles, int nTiles, char *raster, char *format)
+{
+  GDALDatasetH hVRT, hDataset;
+  GDALBuildVRTOptions *vrtOptions;
+  GDALTranslateOptions *translateOptions;
+  char *translateArgs[3];
+  int isVRT, usageError;
+  
+  
+  isVRT = (strcmp(format, "VRT") == 0);
+  
+  // Build a virtual mosaic. The tiles carry their own georeference, hence
+  // the mosaic places each tile at its position. If a VRT is requested,
+  // we write it directly to the output path, otherwise we keep it in memory.
+  vrtOptions = GDALBuildVRTOptionsNew(NULL, NULL);
+  hVRT = GDALBuildVRT(isVRT ? raster : "", nTiles, NULL, 
+            (const char* const*)tiles, vrtOptions, &usageError);
+  GDALBuildVRTOptionsFree(vrtOptions);
+  if (hVRT == NULL)
+  {
+    fprintf(stderr, "ERROR. Unable to build a mosaic from the %i tiles.\n\n", nTiles);
+    return 1;
+  }
+  
+  if (isVRT)
+  {
+    GDALClose(hVRT);
+    return 0;
+  }
+  
+  
+  // Copy the mosaic into a single raster file.
+  translateArgs[0] = "-of";
+  translateArgs[1] = format;
+  translateArgs[2] = NULL;
+  translateOptions = GDALTranslateOptionsNew(translateArgs, NULL);
+  hDataset = GDALTranslate(raster, hVRT, translateOptions, &usageError);
+  GDALTranslateOptionsFree(translateOptions);
+  GDALClose(hVRT);
+  if (hDataset == NULL)
+  {
+    fprintf(stderr, "ERROR. Unable to write merged raster '%s' (format %s).\n\n", raster, format);
+    return 1;
+  }
+  GDALClose(hDataset);
+  
+  
+  return 0;
+}
+
+
+
+
+
+
+
+
+
+/**
+ * Opens an output raster with one band of the given data type for writing
+ * block by block (see raster_open_output_double).
+ */
+static GDALDatasetH raster_open_output (char *raster, char *format, double *adfGeoTransform, 
+               int rasterX, int rasterY, GDALDataType dataType)
+{
+  FILE *fp;
+  GDALDriverH hDriver;
+  GDALDatasetH hDataset;
+  
+  
+  // As in raster_band_write_double, we write to an existing file if there is one.
+  fp = fopen(raster, "r");
+  if (fp)
+  {
+    fclose(fp);
+    hDataset = GDALOpen(raster, GA_Update);
+  }
+  else
+  {
+    hDriver = GDALGetDriverByName(format);
+    if (hDriver == NULL)
+    {
+      fprintf(stderr, "ERROR. Unable to create output raster file.\n");
+      fprintf(stderr, "No driver found for raster format %s\n\n", format);
+      return NULL;
+    }
+    hDataset = GDALCreate(hDriver, raster, rasterX, rasterY, 1, dataType, NULL);
+    if (hDataset != NULL) GDALSetGeoTransform(hDataset, adfGeoTransform);
+  }
+  if (hDataset == NULL)
+  {
+    fprintf(stderr, "ERROR. Unable to open output dataset.\n\n");
+    return NULL;
+  }
+  if (GDALGetRasterXSize(hDataset) != rasterX || GDALGetRasterYSize(hDataset) != rasterY)
+  {
+    fprintf(stderr, "ERROR. The existing output raster '%s' does not have the size %ix%i.\n\n", 
+        raster, rasterX, rasterY);
+    GDALClose(hDataset);
+    return NULL;
+  }
+  
+  return hDataset;
+}
+
+
+
+GDALDatasetH raster_open_output_double (char *raster, char *format, double *adfGeoTransform, 
+               int rasterX, int rasterY)
+{
+  return raster_open_output(raster, format, adfGeoTransform, rasterX, rasterY, GDT_Float64);
+}
+
+
+
+GDALDatasetH raster_open_output_byte (char *raster, char *format, double *adfGeoTransform, 
+               int rasterX, int rasterY)
+{
+  return raster_open_output(raster, format, adfGeoTransform, rasterX, rasterY, GDT_Byte);
+}
+
+
+
+
+GDALDatasetH raster_open_output_cog (char *raster, double *adfGeoTransform, 
+               int rasterX, int rasterY, int blockSize, int nOverviews)
+{
+  GDALDriverH hDriver;
+  GDALDatasetH hDataset;
+  char **options;
+  char value[32];
+  char *oldBlockSize;
+  int levels[32];
+  int i;
+  CPLErr err;
+  
+  hDriver = GDALGetDriverByName("GTiff");
+  if (hDriver == NULL)
+  {
+    fprintf(stderr, "ERROR. Unable to create output raster file.\n");
+    fprintf(stderr, "No driver found for raster format GTiff\n\n");
+    return NULL;
+  }
+  
+  // Internally tiled and compressed; the floating point predictor helps
+  // with the smooth lacunarity values.
+  sprintf(value, "%i", blockSize);
+  options = NULL;
+  options = CSLSetNameValue(options, "TILED", "YES");
+  options = CSLSetNameValue(options, "BLOCKXSIZE", value);
+  options = CSLSetNameValue(options, "BLOCKYSIZE", value);
+  options = CSLSetNameValue(options, "COMPRESS", "DEFLATE");
+  options = CSLSetNameValue(options, "PREDICTOR", "3");
+  options = CSLSetNameValue(options, "BIGTIFF", "IF_SAFER");
+  hDataset = GDALCreate(hDriver, raster, rasterX, rasterY, 1, GDT_Float64, options);
+  CSLDestroy(options);
+  if (hDataset == NULL)
+  {
+    fprintf(stderr, "ERROR. Unable to open output dataset.\n\n");
+    return NULL;
+  }
+  GDALSetGeoTransform(hDataset, adfGeoTransform);
+  
+  // The overviews are only created here ("NONE" does not compute them);
+  // their tiles are written by raster_band_write_overview_blocks().
+  // Their block size is only given by a configuration option, which is set
+  // for this thread and restored afterwards.
+  nOverviews = (nOverviews > 31) ? 31 : nOverviews;
+  for (i = 0; i < nOverviews; i++) levels[i] = 2 << i;
+  err = CE_None;
+  if (nOverviews > 0)
+  {
+    oldBlockSize = CPLStrdup(CPLGetThreadLocalConfigOption("GDAL_TIFF_OVR_BLOCKSIZE", NULL));
+    sprintf(value, "%i", RASTER_COG_OVERVIEW_BLOCK_SIZE);
+    CPLSetThreadLocalConfigOption("GDAL_TIFF_OVR_BLOCKSIZE", value);
+    err = GDALBuildOverviews(hDataset, "NONE", nOverviews, levels, 0, NULL, NULL, NULL);
+    CPLSetThreadLocalConfigOption("GDAL_TIFF_OVR_BLOCKSIZE", 
+      (oldBlockSize[0] != '\0') ? oldBlockSize : NULL);
+    CPLFree(oldBlockSize);
+  }
+  if (err != CE_None)
+  {
+    fprintf(stderr, "ERROR. Unable to create the overviews of the output raster.\n\n");
+    GDALClose(hDataset);
+    return NULL;
+  }
+  
+  return hDataset;
+}
+
+
+
+
+int raster_band_write_overview_blocks (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, double *data, double nodata)
+{
+  GDALRasterBandH overview;
+  double *values, sum;
+  int nOverviews, factor, level, i, j, x, y, n;
+  int ovX, ovY, ovW, ovH;
+  CPLErr err;
+  
+  nOverviews = GDALGetOverviewCount(band);
+  if (nOverviews == 0) return 0;
+  
+  // The first level holds the most values.
+  values = (double*)malloc((size_t)((xSize + 1) / 2) * ((ySize + 1) / 2) * sizeof(double));
+  if (values == NULL)
+  {
+    fprintf(stderr, "ERROR. Not enough memory for the overviews.\n\n");
+    return 1;
+  }
+  
+  for (level = 0; level < nOverviews; level++)
+  {
+    // The window must start on an overview pixel, so that these pixels
+    // are covered by the window alone.
+    factor = 2 << level;
+    if (xOff % factor != 0 || yOff % factor != 0)
+    {
+      fprintf(stderr, "ERROR. Window %i/%i is not aligned with overview level %i.\n\n", 
+          xOff, yOff, level + 1);
+      free(values);
+      return 1;
+    }
+    overview = GDALGetOverview(band, level);
+    ovX = xOff / factor;
+    ovY = yOff / factor;
+    ovW = (xOff + xSize + factor - 1) / factor - ovX;
+    ovH = (yOff + ySize + factor - 1) / factor - ovY;
+    
+    // Each overview pixel is the mean of the valid pixels it covers.
+    for (j = 0; j < ovH; j++)
+    {
+      for (i = 0; i < ovW; i++)
+      {
+        sum = 0;
+        n = 0;
+        for (y = j*factor; y < (j+1)*factor && y < ySize; y++)
+        {
+          for (x = i*factor; x < (i+1)*factor && x < xSize; x++)
+          {
+            if (data[(long)y*xSize + x] == nodata) continue;
+            sum += data[(long)y*xSize + x];
+            n++;
+          }
+        }
+        values[(long)j*ovW + i] = (n > 0) ? sum / n : nodata;
+      }
+    }
+    
+    err = GDALRasterIO(overview, GF_Write, ovX, ovY, ovW, ovH, values, ovW, ovH, GDT_Float64, 0, 0);
+    if (err != CE_None)
+    {
+      fprintf(stderr, "ERROR. Unable to write overview window %i/%i (%ix%i).\n\n", ovX, ovY, ovW, ovH);
+      free(values);
+      return 1;
+    }
+  }
+  
+  free(values);
+  return 0;
+}
+
+
+
+
+int raster_band_write_byte_block (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, unsigned char *data)
+{
+  CPLErr err;
+  
+  err = GDALRasterIO(band, GF_Write, xOff, yOff, xSize, ySize, data, xSize, ySize, GDT_Byte, 0, 0);
+  if (err != CE_None)
+  {
+    fprintf(stderr, "ERROR. Unable to write window %i/%i (%ix%i).\n\n", xOff, yOff, xSize, ySize);
+    return 1;
+  }
+  
+  return 0;
+}
+
+
+
+
+int raster_band_write_double_block (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, double *data)
+{
+  CPLErr err;
+  
+  err = GDALRasterIO(band, GF_Write, xOff, yOff, xSize, ySize, data, xSize, ySize, GDT_Float64, 0, 0);
+  if (err != CE_None)
+  {
+    fprintf(stderr, "ERROR. Unable to write window %i/%i (%ix%i).\n\n", xOff, yOff, xSize, ySize);
+    return 1;
+  }
+  
+  return 0;
+}
+
+
+
+
+
+
+
+
+
 void pixel_coord_to_geo(double *padfTransform, double pixelX, double pixelY, double *geoX, double *geoY)
 {
   *geoX = padfTransform[0] + pixelX*padfTransform[1] + pixelY*padfTransform[2];
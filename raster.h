@@ -17,6 +17,58 @@ int raster_band_read_double (char *raster, int band, double **data, int *rasterX
 int raster_band_read_long (char *raster, int band, long **data, int *rasterX, int *rasterY);
 
 
+/**
+ * Reads a window of a raster band as a long array. The window starts at
+ * pixel xOff/yOff and is xSize by ySize pixels large; it must lie inside
+ * the raster.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+int raster_band_read_long_window (char *raster, int band, 
+               int xOff, int yOff, int xSize, int ySize, long **data);
+
+
+/**
+ * Reads a window of an already opened raster band into a long array
+ * of at least xSize * ySize values.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+int raster_band_read_long_block (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, long *data);
+
+
+
+/**
+ * Returns 1 if some pixels of the band may be invalid (nodata value, alpha
+ * band or mask), and 0 if all pixels are valid.
+ */
+int raster_band_has_mask (GDALRasterBandH band);
+
+
+/**
+ * Returns the maximum value of a band (at least 0), as given by the
+ * dataset or else estimated from an approximate statistics scan.
+ */
+long raster_band_max_value (GDALRasterBandH band);
+
+
+/**
+ * Reads the validity mask of a window of a raster band, as given by
+ * GDALGetMaskBand(): a non-zero value marks a valid pixel, 0 a nodata or
+ * masked pixel. The mask array must hold at least xSize * ySize values.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+int raster_band_read_mask_block (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, unsigned char *mask);
+
+
+/**
+ * Reads the validity mask of a raster band (see raster_band_read_mask_block).
+ * If all pixels of the band are valid, the mask is set to NULL.
+ * Returns 0 in case of success, a non-zero value in case of an error.
+ */
+int raster_band_read_mask (char *raster, int band, unsigned char **mask);
+
+
 
 /**
  * Writes a double data array as a raster band into an output file.
@@ -26,6 +78,88 @@ int raster_band_write_double(char *raster, char *format, int band, double *adfGe
                double *data, int rasterX, int rasterY);
 
 
+/**
+ * Opens an output raster for writing double values block by block.
+ * The raster is created with one band if it does not exist yet; an existing
+ * raster is opened for update and must have the given size.
+ * Returns the dataset, or NULL in case of an error.
+ */
+GDALDatasetH raster_open_output_double (char *raster, char *format, double *adfGeoTransform, 
+               int rasterX, int rasterY);
+
+
+/**
+ * Opens an output raster for writing byte values block by block, as
+ * raster_open_output_double() does for double values.
+ * Returns the dataset, or NULL in case of an error.
+ */
+GDALDatasetH raster_open_output_byte (char *raster, char *format, double *adfGeoTransform, 
+               int rasterX, int rasterY);
+
+
+/**
+ * The size of the internal tiles of the overviews of a COG output raster.
+ * GDAL accepts powers of 2 from 64 to 4096.
+ */
+#define RASTER_COG_OVERVIEW_BLOCK_SIZE 64
+
+
+/**
+ * Creates a Cloud-Optimized GeoTIFF like output raster for writing double
+ * values block by block: a GTiff with internal tiles of blockSize pixels
+ * (a multiple of 16), DEFLATE compression, and nOverviews internal overview
+ * levels with factors 2, 4, 8, ... The overviews are created empty, with
+ * internal tiles of RASTER_COG_OVERVIEW_BLOCK_SIZE pixels; they are filled
+ * by raster_band_write_overview_blocks() as the blocks of the full
+ * resolution band are written. The raster is never read back only if each
+ * window written covers whole overview tiles, i.e. if its size is a
+ * multiple of RASTER_COG_OVERVIEW_BLOCK_SIZE times the largest factor;
+ * otherwise GDAL reads the partial overview tiles back to complete them.
+ * Returns the dataset, or NULL in case of an error.
+ */
+GDALDatasetH raster_open_output_cog (char *raster, double *adfGeoTransform, 
+               int rasterX, int rasterY, int blockSize, int nOverviews);
+
+
+/**
+ * Writes the overview pixels covered by a window of full resolution data
+ * to all overview levels of a band created by raster_open_output_cog().
+ * An overview pixel is the mean of the pixels it covers that are not
+ * nodata. The window must start on a multiple of the largest overview
+ * factor, and reach the raster edge wherever it is not a multiple of it.
+ * Return 0 in case of success, and a non-zero value in case of an error.
+ */
+int raster_band_write_overview_blocks (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, double *data, double nodata);
+
+
+/**
+ * Writes a byte data array into a window of an already opened raster band.
+ * Return 0 in case of success, and a non-zero value in case of an error.
+ */
+int raster_band_write_byte_block (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, unsigned char *data);
+
+
+/**
+ * Writes a double data array into a window of an already opened raster band.
+ * Return 0 in case of success, and a non-zero value in case of an error.
+ */
+int raster_band_write_double_block (GDALRasterBandH band, 
+               int xOff, int yOff, int xSize, int ySize, double *data);
+
+
+
+/**
+ * Assembles several georeferenced raster tiles (e.g. the outputs of sharded
+ * spatial lacunarity runs) into one raster. If the format is VRT, only a
+ * virtual mosaic referencing the tiles is written; otherwise the mosaic is
+ * translated into a single raster file of the given format.
+ * Return 0 in case of success, and a non-zero value in case of an error.
+ */
+int raster_merge (char **tiles, int nTiles, char *raster, char *format);
+
+
 
 
 /**
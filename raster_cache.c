@@ -0,0 +1,220 @@
+#include "raster_cache.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+
+
+#define CACHE_MAGIC "LACCACHE"
+#define CACHE_VERSION 2
+
+/**
+ * The size of the field holding the canonical path of the source raster.
+ */
+#define CACHE_PATH_SIZE 1024
+
+/**
+ * The data and the mask start on multiples of this offset in the file.
+ */
+#define CACHE_ALIGN 4096
+
+
+
+/**
+ * The header at the start of a cache file.
+ */
+typedef struct cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t valueSize;           // sizeof(long) of the writing platform.
+  int32_t rasterX, rasterY;
+  int32_t band;
+  int32_t binary;
+  int64_t binaryThreshold;
+  uint64_t sourceDevice;         // Device and inode of the source raster.
+  uint64_t sourceInode;
+  int64_t sourceSize;           // Size and modification time of the source
+  int64_t sourceTime;           // raster, in seconds and nanoseconds.
+  int64_t sourceTimeNsec;
+  char sourcePath[CACHE_PATH_SIZE]; // Canonical path of the source raster.
+  uint64_t dataOffset;
+  uint64_t maskOffset;          // 0 if all pixels are valid.
+} cache_header;
+
+
+
+/**
+ * Returns the offset following size bytes at offset, rounded up to the
+ * alignment.
+ */
+static uint64_t cache_align (uint64_t offset, uint64_t size)
+{
+  return (offset + size + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+
+
+/**
+ * Fills the fields of a header identifying the run.
+ * Returns 0 in case of success, or 1 if the source raster is not a file
+ * which can be identified, in which case it must not be cached.
+ */
+static int cache_header_init (cache_header *header, char *input_raster, int band,
+            int binary, long binaryThreshold)
+{
+  struct stat st;
+  char path[PATH_MAX];
+
+  memset(header, 0, sizeof(cache_header));
+  memcpy(header->magic, CACHE_MAGIC, 8);
+  header->version = CACHE_VERSION;
+  header->valueSize = sizeof(long);
+  header->band = band;
+  header->binary = binary ? 1 : 0;
+  header->binaryThreshold = binary ? binaryThreshold : 0;
+  if (stat(input_raster, &st) != 0 || realpath(input_raster, path) == NULL ||
+      strlen(path) >= CACHE_PATH_SIZE){
+    return 1;
+  }
+  header->sourceDevice = (uint64_t)st.st_dev;
+  header->sourceInode = (uint64_t)st.st_ino;
+  header->sourceSize = (int64_t)st.st_size;
+  header->sourceTime = (int64_t)st.st_mtime;
+#ifdef __APPLE__
+  header->sourceTimeNsec = (int64_t)st.st_mtimespec.tv_nsec;
+#else
+  header->sourceTimeNsec = (int64_t)st.st_mtim.tv_nsec;
+#endif
+  strcpy(header->sourcePath, path);
+  return 0;
+}
+
+
+
+int raster_cache_open (char *cache_file, char *input_raster, int band,
+            int binary, long binaryThreshold, raster_cache *cache)
+{
+  cache_header expected, *header;
+  struct stat st;
+  uint64_t nPixels;
+  void *map;
+  int fd;
+
+  if (cache_header_init(&expected, input_raster, band, binary, binaryThreshold) != 0) return 1;
+  fd = open(cache_file, O_RDONLY);
+  if (fd < 0) return 1;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(cache_header)){
+    close(fd);
+    return 1;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED){
+    fprintf(stderr, "ERROR. Unable to map the cache file %s.\n", cache_file);
+    return -1;
+  }
+
+  // The cache must have been written for the same source, band and
+  // preparation, and hold all the data.
+  header = (cache_header*)map;
+  nPixels = (uint64_t)(header->rasterX > 0 ? header->rasterX : 0) *
+            (uint64_t)(header->rasterY > 0 ? header->rasterY : 0);
+  if (memcmp(header->magic, expected.magic, 8) != 0 ||
+      header->version != expected.version || header->valueSize != expected.valueSize ||
+      header->band != expected.band || header->binary != expected.binary ||
+      header->binaryThreshold != expected.binaryThreshold ||
+      header->sourceDevice != expected.sourceDevice || header->sourceInode != expected.sourceInode ||
+      header->sourceSize != expected.sourceSize || header->sourceTime != expected.sourceTime ||
+      header->sourceTimeNsec != expected.sourceTimeNsec ||
+      memcmp(header->sourcePath, expected.sourcePath, CACHE_PATH_SIZE) != 0 ||
+      nPixels == 0 || header->dataOffset % CACHE_ALIGN != 0 ||
+      header->dataOffset + nPixels * sizeof(long) > (uint64_t)st.st_size ||
+      (header->maskOffset != 0 && header->maskOffset + nPixels > (uint64_t)st.st_size)){
+    munmap(map, (size_t)st.st_size);
+    return 1;
+  }
+
+  cache->rasterX = header->rasterX;
+  cache->rasterY = header->rasterY;
+  cache->data = (long*)((char*)map + header->dataOffset);
+  cache->mask = (header->maskOffset != 0) ? (unsigned char*)map + header->maskOffset : NULL;
+  cache->map = map;
+  cache->mapSize = (size_t)st.st_size;
+  return 0;
+}
+
+
+
+int raster_cache_write (char *cache_file, char *input_raster, int band,
+            int binary, long binaryThreshold,
+            long *data, unsigned char *mask, int rasterX, int rasterY)
+{
+  cache_header header;
+  char *tmp_file;
+  FILE *fp;
+  size_t nPixels;
+  int ok;
+
+  nPixels = (size_t)rasterX * rasterY;
+  if (cache_header_init(&header, input_raster, band, binary, binaryThreshold) != 0){
+    fprintf(stderr, "Warning. The input raster %s is not a file; the band is not cached.\n",
+      input_raster);
+    return 1;
+  }
+  header.rasterX = rasterX;
+  header.rasterY = rasterY;
+  header.dataOffset = cache_align(0, sizeof(cache_header));
+  header.maskOffset = (mask != NULL) ? cache_align(header.dataOffset, nPixels * sizeof(long)) : 0;
+
+  tmp_file = (char*)malloc(strlen(cache_file) + 32);
+  if (tmp_file == NULL){
+    fprintf(stderr, "ERROR. Not enough memory for the cache file name.\n");
+    return 1;
+  }
+  sprintf(tmp_file, "%s.%ld.tmp", cache_file, (long)getpid());
+  fp = fopen(tmp_file, "wb");
+  if (fp == NULL){
+    fprintf(stderr, "ERROR. Unable to write the cache file %s.\n", tmp_file);
+    free(tmp_file);
+    return 1;
+  }
+
+  // The gaps up to the aligned offsets are left as holes.
+  ok = (fwrite(&header, sizeof(cache_header), 1, fp) == 1) &&
+       (fseek(fp, (long)header.dataOffset, SEEK_SET) == 0) &&
+       (fwrite(data, sizeof(long), nPixels, fp) == nPixels);
+  if (ok && mask != NULL){
+    ok = (fseek(fp, (long)header.maskOffset, SEEK_SET) == 0) &&
+         (fwrite(mask, 1, nPixels, fp) == nPixels);
+  }
+  ok = (fclose(fp) == 0) && ok;
+  if (ok) ok = (rename(tmp_file, cache_file) == 0);
+  if (!ok){
+    fprintf(stderr, "ERROR. Unable to write the cache file %s.\n", cache_file);
+    remove(tmp_file);
+    free(tmp_file);
+    return 1;
+  }
+  free(tmp_file);
+  return 0;
+}
+
+
+
+void raster_cache_close (raster_cache *cache)
+{
+  if (cache->map != NULL) munmap(cache->map, cache->mapSize);
+  cache->map = NULL;
+  cache->data = NULL;
+  cache->mask = NULL;
+}
+
+
+
@@ -0,0 +1,66 @@
+/**
+ * Cache of decoded raster bands in raw sidecar files.
+ *
+ * Reading a compressed raster through GDAL decodes every block again on
+ * each run. The cache stores the prepared band (converted to binary if
+ * needed, with the invalid pixels set to 0) and its validity mask once in
+ * a raw file: a small header, followed by the data and the mask, each
+ * starting on a page boundary. Later runs map the file into memory
+ * read-only, so concurrent processes share the pages of the system file
+ * cache instead of each holding a copy.
+ * The header records the source file (canonical path, device and inode,
+ * size and modification time in nanoseconds), the band and the binary
+ * threshold; a cache not matching the run is rebuilt. Sources which are
+ * not files, such as network or virtual rasters, are never cached.
+ */
+
+#include <stddef.h>
+
+
+
+/**
+ * A mapped cache file. data holds rasterX x rasterY values, row by row;
+ * mask is NULL if all pixels are valid. Both are read-only.
+ */
+typedef struct raster_cache {
+  int rasterX, rasterY;
+  long *data;
+  unsigned char *mask;
+  void *map;                    // The mapped file.
+  size_t mapSize;
+} raster_cache;
+
+
+
+/**
+ * Maps the cache file of a band of a source raster, prepared with the
+ * given binary flag and threshold.
+ * Returns 0 if the cache is mapped, 1 if it does not exist, does not
+ * match the run or the source is not a file (nothing is printed), and -1
+ * in case of an error.
+ */
+int raster_cache_open (char *cache_file, char *input_raster, int band,
+            int binary, long binaryThreshold, raster_cache *cache);
+
+
+
+/**
+ * Writes the prepared data and mask (NULL if all pixels are valid) of a
+ * band to a cache file. The file is written under a temporary name and
+ * then renamed, so other processes only see complete cache files.
+ * Returns 0 in case of success, a non-zero value in case of an error or if
+ * the source is not a file.
+ */
+int raster_cache_write (char *cache_file, char *input_raster, int band,
+            int binary, long binaryThreshold,
+            long *data, unsigned char *mask, int rasterX, int rasterY);
+
+
+
+/**
+ * Unmaps a cache file.
+ */
+void raster_cache_close (raster_cache *cache);
+
+
+
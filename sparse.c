@@ -0,0 +1,301 @@
+#include "sparse.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+
+
+/**
+ * Costs of the sparse path in units of a pixel read by the histogram
+ * engine, measured on random binary images: the searches of the window
+ * rows, per row and binary search step, and the sorting and sweeping of
+ * the events, per event and comparison.
+ */
+#define SPARSE_ROW_COST 9.0
+#define SPARSE_EVENT_COST 6.5
+
+
+
+/**
+ * A change of the number of foreground (fg) or invalid (inv) pixels in
+ * the gliding boxes starting at column x and after.
+ */
+typedef struct sparse_event {
+  int x;
+  int fg;
+  int inv;
+} sparse_event;
+
+static int sparse_event_compare (const void *a, const void *b)
+{
+  return ((const sparse_event*)a)->x - ((const sparse_event*)b)->x;
+}
+
+
+
+/**
+ * Returns the index of the first column of cols[start..end) which is at
+ * least x.
+ */
+static long lower_bound (int *cols, long start, long end, int x)
+{
+  long mid;
+
+  while (start < end){
+    mid = start + (end - start) / 2;
+    if (cols[mid] < x){
+      start = mid + 1;
+    }else{
+      end = mid;
+    }
+  }
+  return start;
+}
+
+
+
+/**
+ * Returns the number of listed pixels in the rectangle x0 <= x < x1,
+ * y0 <= y < y1.
+ */
+static long sparse_count (long *rowStart, int *cols, int x0, int y0, int x1, int y1)
+{
+  long n;
+  int j;
+
+  n = 0;
+  for (j = y0; j < y1; j++){
+    n += lower_bound(cols, rowStart[j], rowStart[j+1], x1) -
+         lower_bound(cols, rowStart[j], rowStart[j+1], x0);
+  }
+  return n;
+}
+
+
+
+double sparse_density (long *data, int pitch, unsigned char *mask,
+            int rasterX, int rasterY)
+{
+  long n;
+  int i, j;
+
+  if (rasterX <= 0 || rasterY <= 0) return 0.0;
+  n = 0;
+  for (j = 0; j < rasterY; j++){
+    for (i = 0; i < rasterX; i++){
+      if (data[(long)j*pitch + i] != 0 || (mask != NULL && !mask[(long)j*rasterX + i])) n++;
+    }
+  }
+  return (double)n / ((double)rasterX * rasterY);
+}
+
+
+
+int sparse_is_faster (double density, int gbox, int mwinW, int mwinH)
+{
+  double nBoxX, nBoxY, nEvents, sparse, dense;
+
+  nBoxX = mwinW - gbox + 1;
+  nBoxY = mwinH - gbox + 1;
+  if (nBoxX <= 0 || nBoxY <= 0) return 0;
+
+  // Every row of gliding boxes sorts the events of the pixels in gbox
+  // rows of the window. The histogram engine scans the window for its
+  // maximum value, and reads gbox^2 pixels per box.
+  nEvents = 2.0 * density * mwinW * gbox;
+  sparse = SPARSE_ROW_COST * mwinH * log2(density * mwinW + 2.0) +
+           SPARSE_EVENT_COST * nBoxY * nEvents * log2(nEvents + 2.0);
+  dense = (double)mwinW * mwinH + nBoxX * nBoxY * gbox * gbox;
+  return sparse < dense;
+}
+
+
+
+sparse_raster *sparse_raster_new (long *data, int pitch, unsigned char *mask,
+            int rasterX, int rasterY)
+{
+  sparse_raster *sparse;
+  long nFg, nInvalid;
+  int i, j;
+
+  // Count the pixels first, so that the lists are allocated only once.
+  nFg = 0;
+  nInvalid = 0;
+  for (j = 0; j < rasterY; j++){
+    for (i = 0; i < rasterX; i++){
+      if (data[(long)j*pitch + i] != 0) nFg++;
+      if (mask != NULL && !mask[(long)j*rasterX + i]) nInvalid++;
+    }
+  }
+
+  sparse = (sparse_raster*)calloc(1, sizeof(sparse_raster));
+  if (sparse == NULL){
+    fprintf(stderr, "ERROR. Not enough memory for the sparse representation.\n");
+    return NULL;
+  }
+  sparse->rasterX = rasterX;
+  sparse->rasterY = rasterY;
+  sparse->rowStart = (long*)malloc((size_t)(rasterY+1) * sizeof(long));
+  sparse->cols = (int*)malloc((size_t)MAX(nFg, 1) * sizeof(int));
+  if (mask != NULL){
+    sparse->invalidStart = (long*)malloc((size_t)(rasterY+1) * sizeof(long));
+    sparse->invalidCols = (int*)malloc((size_t)MAX(nInvalid, 1) * sizeof(int));
+  }
+  if (sparse->rowStart == NULL || sparse->cols == NULL ||
+      (mask != NULL && (sparse->invalidStart == NULL || sparse->invalidCols == NULL))){
+    fprintf(stderr, "ERROR. Not enough memory for the sparse representation.\n");
+    sparse_raster_free(sparse);
+    return NULL;
+  }
+
+  nFg = 0;
+  nInvalid = 0;
+  for (j = 0; j < rasterY; j++){
+    sparse->rowStart[j] = nFg;
+    if (mask != NULL) sparse->invalidStart[j] = nInvalid;
+    for (i = 0; i < rasterX; i++){
+      if (data[(long)j*pitch + i] != 0) sparse->cols[nFg++] = i;
+      if (mask != NULL && !mask[(long)j*rasterX + i]) sparse->invalidCols[nInvalid++] = i;
+    }
+  }
+  sparse->rowStart[rasterY] = nFg;
+  if (mask != NULL) sparse->invalidStart[rasterY] = nInvalid;
+  return sparse;
+}
+
+
+
+void sparse_raster_free (sparse_raster *sparse)
+{
+  if (sparse == NULL) return;
+  free(sparse->rowStart);
+  free(sparse->cols);
+  free(sparse->invalidStart);
+  free(sparse->invalidCols);
+  free(sparse->events);
+  free(sparse);
+}
+
+
+
+/**
+ * Adds the events of the listed pixels of row j between the columns
+ * mwinX and mwinX+mwinW-1 to events.
+ */
+static long row_events (long *rowStart, int *cols, int j, int mwinX, int mwinW,
+            int gbox, int nBoxX, int invalid, sparse_event *events, long nEvents)
+{
+  long n, end;
+  int x, enter, leave;
+
+  end = rowStart[j+1];
+  for (n = lower_bound(cols, rowStart[j], end, mwinX); n < end; n++){
+    x = cols[n] - mwinX;
+    if (x >= mwinW) break;
+    enter = MAX(x - gbox + 1, 0);
+    leave = MIN(x + 1, nBoxX);
+    if (enter >= leave) continue;
+    events[nEvents].x = enter;
+    events[nEvents].fg = invalid ? 0 : 1;
+    events[nEvents].inv = invalid ? 1 : 0;
+    nEvents++;
+    events[nEvents].x = leave;
+    events[nEvents].fg = invalid ? 0 : -1;
+    events[nEvents].inv = invalid ? -1 : 0;
+    nEvents++;
+  }
+  return nEvents;
+}
+
+
+
+double sparse_lacunarity_in_window (sparse_raster *sparse, int gbox,
+            int mwinX, int mwinY, int mwinW, int mwinH)
+{
+  int nBoxX, nBoxY;             // Number of gliding box positions.
+  long nInvalidBoxes;           // Number of boxes touching invalid pixels.
+  long nValidBoxes;
+  double S1, S2;                // Sums of the box masses and their squares.
+  sparse_event *events;
+  long nEvents, maxEvents, n, len;
+  int x, mass, nInvalid;
+  int j, k;
+
+  // Skip windows without any valid pixel, and windows without foreground,
+  // as lacunarity_in_masked_window() does.
+  if (sparse->invalidStart != NULL &&
+      sparse_count(sparse->invalidStart, sparse->invalidCols,
+        mwinX, mwinY, mwinX+mwinW, mwinY+mwinH) == (long)mwinW * mwinH){
+    return LACUNARITY_NODATA;
+  }
+  if (sparse_count(sparse->rowStart, sparse->cols, mwinX, mwinY, mwinX+mwinW, mwinY+mwinH) == 0){
+    return 0.0;
+  }
+  nBoxX = mwinW - gbox + 1;
+  nBoxY = mwinH - gbox + 1;
+  if (nBoxX <= 0 || nBoxY <= 0) return LACUNARITY_NODATA;
+
+  // Every row of boxes sees at most the pixels of gbox rows of the window.
+  maxEvents = 0;
+  for (j = mwinY; j < mwinY + mwinH; j++){
+    n = sparse->rowStart[j+1] - sparse->rowStart[j];
+    if (sparse->invalidStart != NULL) n += sparse->invalidStart[j+1] - sparse->invalidStart[j];
+    maxEvents = MAX(maxEvents, n);
+  }
+  // The buffer of the events is kept for the next windows.
+  maxEvents = 2 * maxEvents * gbox;
+  if (maxEvents > sparse->maxEvents){
+    events = (sparse_event*)realloc(sparse->events, (size_t)maxEvents * sizeof(sparse_event));
+    if (events == NULL){
+      fprintf(stderr, "ERROR. Not enough memory for the sparse gliding boxes.\n");
+      return LACUNARITY_ERROR;
+    }
+    sparse->events = events;
+    sparse->maxEvents = maxEvents;
+  }
+  events = sparse->events;
+
+  nInvalidBoxes = 0;
+  S1 = 0;
+  S2 = 0;
+  for (j = 0; j < nBoxY; j++){
+    nEvents = 0;
+    for (k = mwinY + j; k < mwinY + j + gbox; k++){
+      nEvents = row_events(sparse->rowStart, sparse->cols, k, mwinX, mwinW,
+                  gbox, nBoxX, 0, events, nEvents);
+      if (sparse->invalidStart != NULL){
+        nEvents = row_events(sparse->invalidStart, sparse->invalidCols, k, mwinX, mwinW,
+                    gbox, nBoxX, 1, events, nEvents);
+      }
+    }
+    if (nEvents == 0) continue;
+    qsort(events, nEvents, sizeof(sparse_event), sparse_event_compare);
+
+    // The masses are constant between two events.
+    x = 0;
+    mass = 0;
+    nInvalid = 0;
+    for (n = 0; n < nEvents; n++){
+      len = events[n].x - x;
+      if (len > 0){
+        if (nInvalid > 0){
+          nInvalidBoxes += len;
+        }else if (mass > 0){
+          S1 += (double)len * mass;
+          S2 += (double)len * mass * mass;
+        }
+        x = events[n].x;
+      }
+      mass += events[n].fg;
+      nInvalid += events[n].inv;
+    }
+  }
+
+  nValidBoxes = (long)nBoxX * nBoxY - nInvalidBoxes;
+  if (nValidBoxes == 0) return LACUNARITY_NODATA;
+  return lacunarity_from_moments(S1 / nValidBoxes, S2 / nValidBoxes);
+}
+
+
+
@@ -0,0 +1,93 @@
+/**
+ * Sparse representation of binary images with few foreground pixels.
+ *
+ * The foreground pixels (and the invalid pixels, if any) are stored as
+ * sorted column lists per row. On a binary image, the mass of a gliding box
+ * is its number of foreground pixels, and the lacunarity only needs the
+ * sums of the masses and of their squares over the valid boxes. Along a
+ * row of gliding boxes, each foreground pixel enters the boxes at its
+ * column - gbox + 1 and leaves them after its column, so the masses are
+ * piecewise constant between these events; sweeping over the sorted events
+ * sums up the moments, and the invalid boxes are found the same way. Empty
+ * boxes do not add to the sums, and the number of boxes is known
+ * analytically. The cost is therefore proportional to the number of
+ * foreground and invalid pixels times gbox, instead of the area times
+ * gbox^2.
+ * The results are the same as the ones of lacunarity_in_masked_window() on
+ * binary images.
+ */
+
+
+
+#include "lacunarity.h"
+
+
+
+/**
+ * The foreground and invalid pixels of a binary image, as column lists
+ * per row.
+ */
+typedef struct sparse_raster {
+  int rasterX, rasterY;
+  long *rowStart;               // Start of each row in cols (rasterY+1 values).
+  int *cols;                    // Columns of the foreground pixels.
+  long *invalidStart;           // Start of each row in invalidCols, or NULL
+  int *invalidCols;             // if all pixels are valid.
+  struct sparse_event *events;  // Events of a row of gliding boxes, grown
+  long maxEvents;               // as needed.
+} sparse_raster;
+
+
+
+/**
+ * Returns the fraction of the pixels of a binary data array of rasterX x
+ * rasterY pixels with rows pitch values apart which are foreground or
+ * invalid. The mask (rasterX values per row) may be NULL if all pixels
+ * are valid.
+ */
+double sparse_density (long *data, int pitch, unsigned char *mask,
+            int rasterX, int rasterY);
+
+
+
+/**
+ * Returns 1 if the sparse representation of a binary image with the given
+ * fraction of foreground and invalid pixels (see sparse_density) is
+ * expected to compute the lacunarity of moving windows of mwinW x mwinH
+ * pixels for a gliding box of size gbox faster than
+ * lacunarity_in_masked_window(), and 0 otherwise. The estimate weighs the
+ * searches and the sorted events of every row of gliding boxes against the
+ * gbox^2 pixels read per box.
+ */
+int sparse_is_faster (double density, int gbox, int mwinW, int mwinH);
+
+
+
+/**
+ * Builds the sparse representation of a binary data array, with the
+ * invalid pixels set to 0 (see sparse_density for the arguments).
+ * Returns the new representation, or NULL in case of an error.
+ */
+sparse_raster *sparse_raster_new (long *data, int pitch, unsigned char *mask,
+            int rasterX, int rasterY);
+
+
+
+/**
+ * Frees a sparse representation.
+ */
+void sparse_raster_free (sparse_raster *sparse);
+
+
+
+/**
+ * Computes the binary lacunarity of a moving window of mwinW x mwinH
+ * pixels at mwinX/mwinY for a gliding box of size gbox. The representation
+ * keeps a buffer of the events, hence it must not be shared by threads.
+ * Returns LACUNARITY_ERROR in case of an error.
+ */
+double sparse_lacunarity_in_window (sparse_raster *sparse, int gbox,
+            int mwinX, int mwinY, int mwinW, int mwinH);
+
+
+
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Regression checks of r.lacunarity on the test rasters (run by make check).
+
+R=./r.lacunarity
+failed=0
+
+# Prints the value of the last gliding box size of a global run.
+last_value () {
+  $R "$@" | awk -F'\t' '$1 ~ /^[0-9]+$/ { v = $2 } END { print v }'
+}
+
+# check name expected arguments...
+check () {
+  name=$1
+  expected=$2
+  shift 2
+  value=$(last_value "$@")
+  if [ "$value" != "$expected" ]; then
+    echo "FAILED: $name: $value instead of $expected"
+    failed=1
+  fi
+}
+
+# check_thresholds name thresholds arguments...
+# Compares the curves of --binaryThresholds with separate runs per threshold.
+check_thresholds () {
+  name=$1
+  thresholds=$2
+  shift 2
+  curves=$($R "$@" --binaryThresholds "$thresholds" | awk -F'\t' '$1 ~ /^[0-9]+$/')
+  column=2
+  for t in $(echo "$thresholds" | tr ',' ' '); do
+    expected=$($R "$@" --binary --binaryThreshold "$t" | awk -F'\t' '$1 ~ /^[0-9]+$/ { print $1, $2 }')
+    value=$(echo "$curves" | awk -F'\t' -v c=$column '{ print $1, $c }')
+    if [ -z "$value" ] || [ "$value" != "$expected" ]; then
+      echo "FAILED: $name: threshold $t differs from a separate run"
+      failed=1
+    fi
+    column=$((column + 1))
+  done
+}
+
+# check_rejected name arguments...
+# The arguments must be rejected with an error.
+check_rejected () {
+  name=$1
+  shift
+  if $R "$@" > /dev/null 2>&1; then
+    echo "FAILED: $name: accepted"
+    failed=1
+  fi
+}
+
+# All valid gliding boxes are empty: the only foreground pixel lies in a
+# box touching nodata.
+check "empty valid boxes" 0.000000 --input testdata/nodata4.asc --gbox 2
+check "empty valid boxes, binary" 0.000000 --input testdata/nodata4.asc --gbox 2 --binary
+check "empty valid boxes, integral" 0.000000 --input testdata/nodata4.asc --gbox 2 --engine integral
+check "empty valid boxes, integral 3d" 0.000000 --input testdata/nodata4.asc --gbox 2 --3d --engine integral
+check "empty valid boxes, sparse" 0.000000 --input testdata/nodata64.asc --gbox 2 --binary
+check_thresholds "empty valid boxes, thresholds" 1,2 --input testdata/nodata4.asc --gboxMin 1 --gboxMax 3
+
+# Several thresholds in one pass give the same curves as separate runs,
+# also with nodata pixels and for an empty thresholded image.
+check_thresholds "thresholds with nodata" 1,5,8,13 --input testdata/nodata12.asc --gboxMin 1 --gboxMax 6
+
+# Options that only apply to the spatial lacunarity.
+check_rejected "shard without spatial" --input testdata/toy5.asc --gbox 2 --shard 0/4
+
+if [ $failed -eq 0 ]; then
+  echo "All checks passed."
+fi
+exit $failed